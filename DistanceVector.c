@@ -0,0 +1,1065 @@
+/* ******************************************************************
+   DISTANCE VECTOR ROUTING SIMULATOR.  Adapted from J.F.Kurose
+
+   Simulates distance vector routing over a topology read from an edge
+   list file.  It uses the same discrete event core as the emulator in
+   emulator.c: an event list kept as a binary heap, and links that behave
+   like the emulator's medium:
+   - each link delivers routing packets in the order they were sent,
+   between 1 and 10 time units after the latest arrival on that link
+   - packets can be corrupted or lost, according to user-defined
+   probabilities.  Corrupted packets are detected by their checksum and
+   discarded by the receiver.
+
+   Each node keeps its row of the distance table (cost to every
+   destination and the neighbour it goes through).  When a row changes
+   the node sends a triggered update holding the changed entries to each
+   neighbour, applying split horizon or poison reverse.  Large updates are
+   sent as whole rows, which the receiver relaxes with vector min-plus
+   instructions.  Nodes can also send their whole row periodically, which
+   is needed to converge when packets are lost.
+
+   A node keeps only its best route to each destination, so it accepts
+   any change to a route from the neighbour the route goes through, and
+   when routes get worse it asks its other neighbours for their routes
+   to just those destinations.  The replies are ordinary updates, so
+   stale routes looping back through the node come back just as they
+   would from a stored table, and count to infinity.  Routes costing at
+   least the cost given for unreachable are unreachable; without one,
+   counting to infinity under "advertise all" takes a very long time.
+
+   The edge list file holds one link per line: "node node cost", with
+   nodes numbered from 0 and costs > 0.  Lines starting with # are
+   ignored.
+
+   The optional link change file holds one change per line: "time node
+   node cost", with cost 0 to take the link down, for links that are in
+   the edge list.  At that time both ends see the new cost at once.
+   Routes through the link change by the same amount, a cheaper link
+   also has each end ask the other for its whole row, and the changed
+   routes go out as triggered updates.  For each change the simulator
+   reports the time until the last table change before the next link
+   change, the routing packets sent until then, and the destinations
+   for which a route got worse through a routing loop (count to
+   infinity).
+
+   Build:  gcc -O2 -march=native -o dv DistanceVector.c
+**********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define  INFINITY_COST  (1 << 29)  /* cost of an unreachable destination */
+#define  MAXNEIGHBOURS  65535      /* neighbours are numbered in an unsigned short */
+#define  QUIETPERIODS   3          /* periodic updates stop after this many periods without change */
+#define  VERIFYSOURCES  20         /* rows checked against Dijkstra at the end */
+
+/* how routes are advertised back to the neighbour they go through: */
+#define  ADVERTISE_ALL     0
+#define  SPLIT_HORIZON     1
+#define  POISON_REVERSE    2
+
+/* possible events: */
+#define  FROM_LAYER2       0       /* routing packet arrives at a node */
+#define  PERIODIC_UPDATE   1       /* node sends its whole row to its neighbours */
+#define  TRIGGERED_UPDATE  2       /* node sends the routes changed since its last update */
+#define  LINK_CHANGE       3       /* a link changes cost or fails */
+
+struct rtpkt {            /* routing packet sent over a link */
+  int sourceid;           /* node sending the packet */
+  int link;               /* link (index at the receiver) it arrives on */
+  int nentries;           /* number of entries */
+  int dense;              /* entries are a whole row, dest[] is not used */
+  int request;            /* asks for the receiver's routes to the entries' destinations */
+  int checksum;
+  int *dest;              /* destination of each entry */
+  int *cost;              /* advertised cost of each entry */
+};
+
+struct event {
+  float evtime;           /* event time */
+  int evtype;             /* event type code */
+  int evnode;             /* node where event occurs */
+  int evchange;           /* index of the link change (if any) */
+  int evindex;            /* position of the event in the event list */
+  unsigned long long evseq;  /* order in which events were scheduled */
+  struct rtpkt *pktptr;   /* ptr to packet (if any) assoc w/ this event */
+};
+
+int TRACE = 0;
+
+/* topology, as adjacency lists: the links of node x are linkstart[x] .. */
+/* linkstart[x+1]-1, link l goes to node linknode[l] with cost linkcost[l] */
+/* and linkrev[l] is the same link seen from the other end                */
+static int nnodes;
+static int nlinks;
+static int *linkstart;
+static int *linknode;
+static int *linkcost;
+static int *linkrev;
+static float *lastarrival;       /* latest arrival on each link, for in order delivery */
+
+struct linkchange {       /* a link change from the schedule, and what it caused */
+  float time;
+  int node, neighbour;
+  int cost;               /* new cost, INFINITY_COST if the link fails */
+  int link;               /* the link from node to neighbour */
+  long packets_before;    /* routing packets sent before the change */
+  long changes_before;    /* distance table entries changed before it */
+  float converged;        /* time from the change to the last table change */
+  long packets;           /* routing packets sent in that time */
+  long changes;           /* table entries changed before the next change */
+  int counted;            /* destinations that counted to infinity */
+};
+
+static struct linkchange *linkchanges;
+static int nlinkchanges;
+static int currentchange = -1;   /* the latest link change, -1 before the first */
+static int *countedat;           /* latest change for which each destination counted to infinity */
+
+/* distance tables: row x is the cost from x to each destination, and the */
+/* neighbour (numbered from 0 in x's adjacency list) the route goes through */
+static int stride;               /* row length, rounded up for vector instructions */
+static int *dist;
+static unsigned short *via;
+static int *changed;             /* scratch list of destinations whose cost changed */
+static int *worsened;            /* scratch list of those whose cost went up */
+static int words;                /* words in each row of the dirty bitmap */
+static unsigned long long *dirty;   /* routes changed and not yet sent, per node */
+static char *triggered;          /* node has a triggered update scheduled */
+static char *periodic;           /* node has a periodic update scheduled */
+
+static struct event **evlist = NULL;   /* the event list */
+static int nevents = 0;
+static int maxevents = 0;
+static unsigned long long nscheduled = 0;
+
+static float time = 0.000;
+static float lossprob;           /* probability that a packet is dropped  */
+static float corruptprob;        /* probability that a packet is corrupted */
+static int advertise;            /* ADVERTISE_ALL, SPLIT_HORIZON or POISON_REVERSE */
+static float period;             /* time between periodic updates, 0 = triggered only */
+static float holddown;           /* delay for triggered updates, so changes are sent together */
+static int densepercent;         /* send whole rows when more than this % of entries changed */
+static int maxcost;              /* routes costing this much are unreachable */
+
+/* statistics */
+static long packets_sent;
+static long entries_sent;
+static long packets_lost;
+static long packets_corrupt;
+static long table_changes;
+static float lastchange;         /* time of the last change to any distance table */
+static long packets_at_lastchange;
+
+/****************************************************************************/
+/* jimsrand(): return a double in range [0,1].  The routine below is used to */
+/* isolate all random number generation in one location.                    */
+/****************************************************************************/
+double jimsrand(void)
+{
+  double mmm = RAND_MAX;
+  double x;
+  x = rand()/mmm;            /* x should be uniform in [0,1] */
+  return(x);
+}
+
+static void *allocate(size_t size)
+{
+  void *p = malloc(size);
+
+  if (p == 0) {
+    printf("memory allocation failed.");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/********************* EVENT HANDLING ROUTINES *******/
+/*  The next set of routines handle the event list   */
+/*****************************************************/
+
+static int evbefore(struct event *p, struct event *q)
+{
+  if (p->evtime != q->evtime)
+    return p->evtime < q->evtime;
+  return p->evseq > q->evseq;
+}
+
+static void evplace(struct event *p, int i)
+{
+  evlist[i] = p;
+  p->evindex = i;
+}
+
+void insertevent(struct event *p)
+{
+  int i, parent;
+
+  if (nevents == maxevents) {
+    maxevents = (maxevents == 0) ? 1024 : 2*maxevents;
+    evlist = realloc(evlist, maxevents * sizeof(struct event *));
+    if (evlist == 0) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  p->evseq = nscheduled++;
+  for (i = nevents++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (!evbefore(p, evlist[parent]))
+      break;
+    evplace(evlist[parent], i);
+  }
+  evplace(p, i);
+}
+
+/* remove and return the next event to simulate, or NULL when there are none */
+struct event *takeevent(void)
+{
+  struct event *first, *last;
+  int i, child;
+
+  if (nevents == 0)
+    return NULL;
+  first = evlist[0];
+  last = evlist[--nevents];
+  for (i = 0; (child = 2*i + 1) < nevents; i = child) {
+    if (child + 1 < nevents && evbefore(evlist[child + 1], evlist[child]))
+      child++;
+    if (!evbefore(evlist[child], last))
+      break;
+    evplace(evlist[child], i);
+  }
+  if (nevents > 0)
+    evplace(last, i);
+  return first;
+}
+
+/********************** ROUTING PACKETS ***********************/
+
+static int ComputeChecksum(struct rtpkt *packet)
+{
+  int checksum = packet->sourceid + packet->nentries + 7 * packet->request;
+  int i;
+
+  for (i = 0; i < packet->nentries; i++)
+    checksum += packet->cost[i] + (packet->dense ? 0 : 31 * packet->dest[i]);
+  return checksum;
+}
+
+static void freepkt(struct rtpkt *packet)
+{
+  free(packet->dest);
+  free(packet->cost);
+  free(packet);
+}
+
+/* send packet from node x over its link l.  The link loses, corrupts and */
+/* delays packets like the emulator's medium does.                        */
+void tolayer2(int x, int l, struct rtpkt *packet)
+{
+  struct event *evptr;
+  float lastime;
+
+  packets_sent++;
+  entries_sent += packet->nentries;
+  packet->sourceid = x;
+  packet->link = linkrev[l];
+  packet->checksum = ComputeChecksum(packet);
+
+  /* simulate losses: */
+  if (jimsrand() < lossprob) {
+    packets_lost++;
+    if (TRACE>1)
+      printf("          TOLAYER2: packet from %d to %d being lost\n", x, linknode[l]);
+    freepkt(packet);
+    return;
+  }
+
+  evptr = allocate(sizeof(struct event));
+  evptr->evtype = FROM_LAYER2;
+  evptr->evnode = linknode[l];
+  evptr->pktptr = packet;
+
+  /* links can not reorder, so make sure packet arrives between 1 and 10 */
+  /* time units after the latest arrival on this link                    */
+  lastime = time;
+  if (lastarrival[l] > lastime)
+    lastime = lastarrival[l];
+  evptr->evtime = lastime + 1 + 9*jimsrand();
+  lastarrival[l] = evptr->evtime;
+
+  /* simulate corruption: */
+  if (jimsrand() < corruptprob && packet->nentries > 0) {
+    packet->cost[0] ^= 0x5a5a;
+    if (TRACE>1)
+      printf("          TOLAYER2: packet from %d to %d being corrupted\n", x, linknode[l]);
+  }
+  insertevent(evptr);
+}
+
+/* cost node x advertises for destination y over its link l */
+static int advertised(int x, int l, int y)
+{
+  if (advertise != ADVERTISE_ALL && y != x
+      && via[(size_t)x*stride + y] == l - linkstart[x])
+    return INFINITY_COST;          /* route goes back through this neighbour */
+  return dist[(size_t)x*stride + y];
+}
+
+/* send the ncount destinations in list to the neighbour of x over link */
+/* l, or the whole row if list is NULL or most of the row has changed    */
+static void sendroutes(int x, int l, const int *list, int ncount)
+{
+  struct rtpkt *packet;
+  int i, y, n;
+
+  if (linkcost[l] == INFINITY_COST)
+    return;                        /* the link is down */
+  packet = allocate(sizeof(struct rtpkt));
+  packet->request = 0;
+  if (list == NULL || 100L*ncount > (long)densepercent*nnodes) {
+    packet->dense = 1;
+    packet->nentries = stride;
+    packet->dest = NULL;
+    packet->cost = allocate(stride * sizeof(int));
+    for (y = 0; y < stride; y++)
+      packet->cost[y] = (y < nnodes) ? advertised(x, l, y) : INFINITY_COST;
+  }
+  else {
+    packet->dense = 0;
+    packet->dest = allocate(ncount * sizeof(int));
+    packet->cost = allocate(ncount * sizeof(int));
+    for (i = n = 0; i < ncount; i++) {
+      y = list[i];
+      if (advertise == SPLIT_HORIZON && advertised(x, l, y) == INFINITY_COST
+          && dist[(size_t)x*stride + y] != INFINITY_COST)
+        continue;                  /* split horizon: say nothing about it */
+      packet->dest[n] = y;
+      packet->cost[n++] = advertised(x, l, y);
+    }
+    packet->nentries = n;
+    if (n == 0) {
+      freepkt(packet);
+      return;
+    }
+  }
+  tolayer2(x, l, packet);
+}
+
+/* send the ncount destinations in list to every neighbour of x, or the */
+/* whole row if list is NULL or most of the row has changed             */
+void sendupdate(int x, const int *list, int ncount)
+{
+  int l;
+
+  if (list != NULL && ncount == 0)
+    return;
+  for (l = linkstart[x]; l < linkstart[x+1]; l++)
+    sendroutes(x, l, list, ncount);
+}
+
+/* ask the neighbour of x over link l for its routes to the ncount */
+/* destinations in list, or for its whole row if list is NULL      */
+static void sendrequest(int x, int l, const int *list, int ncount)
+{
+  struct rtpkt *packet;
+
+  if (linkcost[l] == INFINITY_COST)
+    return;
+  packet = allocate(sizeof(struct rtpkt));
+  packet->request = 1;
+  packet->dense = (list == NULL);
+  packet->nentries = (list == NULL) ? 0 : ncount;
+  packet->dest = NULL;
+  packet->cost = NULL;
+  if (list != NULL) {
+    packet->dest = allocate(ncount * sizeof(int));
+    packet->cost = calloc(ncount, sizeof(int));
+    if (packet->cost == NULL) {
+      printf("memory allocation failed.");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(packet->dest, list, ncount * sizeof(int));
+  }
+  tolayer2(x, l, packet);
+}
+
+/* routes costing maxcost or more are unreachable */
+static int capcost(int cost)
+{
+  return (cost >= maxcost) ? INFINITY_COST : cost;
+}
+
+/* whether the route of neighbour n to y leads back to x */
+static int loopsback(int n, int x, int y)
+{
+  int hops, v;
+
+  for (hops = 0; hops < nnodes && n != y; hops++) {
+    if (n == x)
+      return 1;
+    v = via[(size_t)n*stride + y];
+    if (v == MAXNEIGHBOURS || dist[(size_t)n*stride + y] == INFINITY_COST)
+      return 0;
+    n = linknode[linkstart[n] + v];
+  }
+  return 0;
+}
+
+/* x has taken a route to y through its neighbour at slot.  If that route */
+/* loops back to x, the costs round the loop count up to infinity, which  */
+/* is charged to the latest link change                                   */
+static void checkloop(int x, int slot, int y)
+{
+  if (currentchange < 0 || countedat[y] == currentchange
+      || dist[(size_t)x*stride + y] == INFINITY_COST
+      || !loopsback(linknode[linkstart[x] + slot], x, y))
+    return;
+  countedat[y] = currentchange;
+  linkchanges[currentchange].counted++;
+  if (TRACE>0)
+    printf("time %f: route from %d to %d loops, counting to infinity\n", time, x, y);
+}
+
+/* the next hop of x at slot says its route to y now costs more, so x's */
+/* route costs cand.  Returns the new length of the worsened list       */
+static int worsen(int x, int slot, int y, int cand, int nworse)
+{
+  dist[(size_t)x*stride + y] = cand;
+  worsened[nworse++] = y;
+  checkloop(x, slot, y);
+  return nworse;
+}
+
+/* min-plus relaxation of row x by a whole row advertised over its link */
+/* slot (cost c).  Destinations that got cheaper are added to changed,  */
+/* and so are routes through slot that got dearer, which are also added */
+/* to worsened                                                          */
+static int relaxdense(int x, int slot, int c, const int *adv, int nchanged, int *nworse)
+{
+  int *row = dist + (size_t)x*stride;
+  unsigned short *rowvia = via + (size_t)x*stride;
+  int y = 0;
+  int cand;
+#ifdef __AVX2__
+  __m256i vc = _mm256_set1_epi32(c);
+  __m256i vmax = _mm256_set1_epi32(maxcost - 1);
+  __m256i vinf = _mm256_set1_epi32(INFINITY_COST);
+  __m256i vslot = _mm256_set1_epi32(slot);
+  __m256i cur, vcand, next;
+  int mask, worse, b;
+
+  for (; y + 8 <= stride; y += 8) {
+    vcand = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(adv + y)), vc);
+    vcand = _mm256_blendv_epi8(vcand, vinf, _mm256_cmpgt_epi32(vcand, vmax));
+    cur = _mm256_load_si256((const __m256i *)(row + y));
+    next = _mm256_cmpeq_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(rowvia + y))), vslot);
+    mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(cur, vcand)));
+    worse = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(next, _mm256_cmpgt_epi32(vcand, cur))));
+    if ((mask | worse) == 0)
+      continue;
+    _mm256_store_si256((__m256i *)(row + y), _mm256_min_epi32(cur, vcand));
+    while (mask != 0) {
+      b = __builtin_ctz(mask);
+      rowvia[y + b] = slot;
+      changed[nchanged++] = y + b;
+      checkloop(x, slot, y + b);
+      mask &= mask - 1;
+    }
+    while (worse != 0) {
+      b = __builtin_ctz(worse);
+      changed[nchanged++] = y + b;
+      *nworse = worsen(x, slot, y + b, capcost(c + adv[y + b]), *nworse);
+      worse &= worse - 1;
+    }
+  }
+#endif
+  for (; y < stride; y++) {
+    cand = capcost(c + adv[y]);
+    if (cand < row[y]) {
+      row[y] = cand;
+      rowvia[y] = slot;
+      changed[nchanged++] = y;
+      checkloop(x, slot, y);
+    }
+    else if (cand > row[y] && rowvia[y] == slot) {
+      changed[nchanged++] = y;
+      *nworse = worsen(x, slot, y, cand, *nworse);
+    }
+  }
+  return nchanged;
+}
+
+/* relaxation of row x by the entries of a partial update */
+static int relaxsparse(int x, int slot, int c, const struct rtpkt *packet, int nchanged, int *nworse)
+{
+  int *row = dist + (size_t)x*stride;
+  unsigned short *rowvia = via + (size_t)x*stride;
+  int i, y, cand;
+
+  for (i = 0; i < packet->nentries; i++) {
+    y = packet->dest[i];
+    if (y < 0 || y >= nnodes)
+      continue;
+    cand = capcost(c + packet->cost[i]);
+    if (cand < row[y]) {
+      row[y] = cand;
+      rowvia[y] = slot;
+      changed[nchanged++] = y;
+      checkloop(x, slot, y);
+    }
+    else if (cand > row[y] && rowvia[y] == slot) {
+      changed[nchanged++] = y;
+      *nworse = worsen(x, slot, y, cand, *nworse);
+    }
+  }
+  return nchanged;
+}
+
+void scheduleupdate(int x, int evtype, float delay)
+{
+  struct event *evptr = allocate(sizeof(struct event));
+
+  evptr->evtype = evtype;
+  evptr->evnode = x;
+  evptr->pktptr = NULL;
+  evptr->evtime = time + delay;
+  insertevent(evptr);
+}
+
+/* the ncount routes in list have changed at node x: schedule a triggered */
+/* update, which also carries any other routes changed before it is sent  */
+void routeschanged(int x, const int *list, int ncount)
+{
+  unsigned long long *row = dirty + (size_t)x*words;
+  int i;
+
+  for (i = 0; i < ncount; i++)
+    row[list[i] >> 6] |= 1ULL << (list[i] & 63);
+  if (!triggered[x]) {
+    triggered[x] = 1;
+    scheduleupdate(x, TRIGGERED_UPDATE, holddown);
+  }
+}
+
+/* send the routes changed at node x since its last update */
+void sendtriggered(int x)
+{
+  unsigned long long *row = dirty + (size_t)x*words;
+  unsigned long long bits;
+  int w, n = 0;
+
+  for (w = 0; w < words; w++) {
+    for (bits = row[w]; bits != 0; bits &= bits - 1)
+      changed[n++] = 64*w + __builtin_ctzll(bits);
+    row[w] = 0;
+  }
+  triggered[x] = 0;
+  sendupdate(x, changed, n);
+}
+
+/* x's routes to the nworse destinations in worsened got dearer through */
+/* link l: ask its other neighbours for theirs                          */
+static void askneighbours(int x, int l, int nworse)
+{
+  int k;
+
+  for (k = linkstart[x]; k < linkstart[x+1]; k++)
+    if (k != l)
+      sendrequest(x, k, worsened, nworse);
+}
+
+/* called when a routing packet arrives at node x */
+void rtupdate(int x, struct rtpkt *packet)
+{
+  int slot, nchanged, nworse = 0;
+
+  if (packet->checksum != ComputeChecksum(packet)) {
+    packets_corrupt++;
+    if (TRACE>1)
+      printf("          RTUPDATE: corrupted packet from %d discarded at %d\n", packet->sourceid, x);
+    return;
+  }
+  if (linkcost[packet->link] == INFINITY_COST) {
+    packets_lost++;                /* the link went down with the packet on it */
+    return;
+  }
+  if (packet->request) {
+    sendroutes(x, packet->link, packet->dense ? NULL : packet->dest, packet->nentries);
+    return;
+  }
+
+  slot = packet->link - linkstart[x];
+  if (packet->dense)
+    nchanged = relaxdense(x, slot, linkcost[packet->link], packet->cost, 0, &nworse);
+  else
+    nchanged = relaxsparse(x, slot, linkcost[packet->link], packet, 0, &nworse);
+
+  if (nchanged > 0) {
+    table_changes += nchanged;
+    lastchange = time;
+    packets_at_lastchange = packets_sent;
+    if (TRACE>0)
+      printf("time %f: %d routes at node %d changed after update from %d\n",
+             time, nchanged, x, packet->sourceid);
+    routeschanged(x, changed, nchanged);
+  }
+  if (nworse > 0)
+    askneighbours(x, packet->link, nworse);
+}
+
+/********************** TOPOLOGY ***********************/
+
+static int cmplink(const void *a, const void *b)
+{
+  const int *p = a, *q = b;
+
+  if (p[0] != q[0])
+    return p[0] - q[0];
+  return p[1] - q[1];
+}
+
+/* the link from u to v, or -1 if there is none */
+static int findlink(int u, int v)
+{
+  int lo = linkstart[u], hi = linkstart[u+1] - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (linknode[mid] < v)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo <= hi && linknode[lo] == v) ? lo : -1;
+}
+
+/* read the edge list in file into the adjacency lists */
+void readtopology(const char *file)
+{
+  FILE *fp;
+  char line[256];
+  int *edges = NULL;              /* (node, neighbour, cost, reverse) per link */
+  int maxedges = 0, nedges = 0;
+  int u, v, c, i, l;
+
+  fp = fopen(file, "r");
+  if (fp == NULL) {
+    printf("unable to open topology file %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+  nnodes = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%d %d %d", &u, &v, &c) != 3)
+      continue;
+    if (u < 0 || v < 0 || u == v || c <= 0 || c >= INFINITY_COST / 4096) {
+      printf("ignoring bad link: %s", line);
+      continue;
+    }
+    if (nedges + 2 > maxedges) {
+      maxedges = (maxedges == 0) ? 1024 : 2*maxedges;
+      edges = realloc(edges, maxedges * 4 * sizeof(int));
+      if (edges == 0) {
+        printf("memory allocation for topology failed.");
+        exit(EXIT_FAILURE);
+      }
+    }
+    edges[4*nedges] = u;    edges[4*nedges+1] = v;  edges[4*nedges+2] = c;
+    nedges++;
+    edges[4*nedges] = v;    edges[4*nedges+1] = u;  edges[4*nedges+2] = c;
+    nedges++;
+    if (u >= nnodes) nnodes = u + 1;
+    if (v >= nnodes) nnodes = v + 1;
+  }
+  fclose(fp);
+  if (nnodes == 0) {
+    printf("no links in topology file %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+
+  /* sort the links by node, dropping repeated links */
+  qsort(edges, nedges, 4 * sizeof(int), cmplink);
+  for (i = l = 0; i < nedges; i++)
+    if (l == 0 || cmplink(&edges[4*i], &edges[4*(l-1)]) != 0)
+      memmove(&edges[4*l++], &edges[4*i], 4 * sizeof(int));
+  nlinks = l;
+
+  linkstart = allocate((nnodes + 1) * sizeof(int));
+  linknode = allocate(nlinks * sizeof(int));
+  linkcost = allocate(nlinks * sizeof(int));
+  linkrev = allocate(nlinks * sizeof(int));
+  lastarrival = allocate(nlinks * sizeof(float));
+  for (u = 0, l = 0; u <= nnodes; u++) {
+    while (l < nlinks && edges[4*l] < u)
+      l++;
+    linkstart[u] = l;
+  }
+  for (l = 0; l < nlinks; l++) {
+    linknode[l] = edges[4*l+1];
+    linkcost[l] = edges[4*l+2];
+    lastarrival[l] = 0.0;
+  }
+  for (u = 0; u < nnodes; u++) {
+    if (linkstart[u+1] - linkstart[u] > MAXNEIGHBOURS) {
+      printf("node %d has more than %d neighbours\n", u, MAXNEIGHBOURS);
+      exit(EXIT_FAILURE);
+    }
+    /* the reverse of u->v is found by binary search in v's sorted links */
+    for (l = linkstart[u]; l < linkstart[u+1]; l++)
+      linkrev[l] = findlink(linknode[l], u);
+  }
+  free(edges);
+}
+
+/********************** LINK CHANGES ***********************/
+
+static int cmpchange(const void *a, const void *b)
+{
+  const struct linkchange *p = a, *q = b;
+
+  return (p->time > q->time) - (p->time < q->time);
+}
+
+/* read the schedule of link changes in file, and put them on the event list */
+void readchanges(const char *file)
+{
+  FILE *fp;
+  char line[256];
+  struct linkchange ch;
+  struct event *evptr;
+  int maxchanges = 0, i;
+
+  fp = fopen(file, "r");
+  if (fp == NULL) {
+    printf("unable to open link change file %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%f %d %d %d", &ch.time, &ch.node, &ch.neighbour, &ch.cost) != 4)
+      continue;
+    if (ch.node < 0 || ch.node >= nnodes || ch.neighbour < 0 || ch.neighbour >= nnodes
+        || ch.time < 0.0 || ch.cost < 0 || ch.cost >= INFINITY_COST / 4096
+        || (ch.link = findlink(ch.node, ch.neighbour)) < 0) {
+      printf("ignoring bad link change: %s", line);
+      continue;
+    }
+    if (ch.cost == 0)
+      ch.cost = INFINITY_COST;
+    ch.counted = 0;
+    if (nlinkchanges == maxchanges) {
+      maxchanges = (maxchanges == 0) ? 64 : 2*maxchanges;
+      linkchanges = realloc(linkchanges, maxchanges * sizeof(struct linkchange));
+      if (linkchanges == 0) {
+        printf("memory allocation for link changes failed.");
+        exit(EXIT_FAILURE);
+      }
+    }
+    linkchanges[nlinkchanges++] = ch;
+  }
+  fclose(fp);
+
+  qsort(linkchanges, nlinkchanges, sizeof(struct linkchange), cmpchange);
+  for (i = 0; i < nlinkchanges; i++) {
+    evptr = allocate(sizeof(struct event));
+    evptr->evtype = LINK_CHANGE;
+    evptr->evnode = linkchanges[i].node;
+    evptr->evchange = i;
+    evptr->pktptr = NULL;
+    evptr->evtime = linkchanges[i].time;
+    insertevent(evptr);
+  }
+}
+
+/* node x sees the cost of its link l change from old */
+static void endchanged(int x, int l, int old)
+{
+  int *row = dist + (size_t)x*stride;
+  unsigned short *rowvia = via + (size_t)x*stride;
+  int slot = l - linkstart[x], cost = linkcost[l];
+  int y, cand, nchanged = 0, nworse = 0;
+
+  /* routes through the link change by as much as the link did */
+  for (y = 0; y < nnodes; y++) {
+    if (rowvia[y] != slot || row[y] == INFINITY_COST)
+      continue;
+    cand = (cost == INFINITY_COST) ? INFINITY_COST : capcost(row[y] - old + cost);
+    if (cand > row[y])
+      worsened[nworse++] = y;
+    row[y] = cand;
+    changed[nchanged++] = y;
+  }
+  /* a cheaper link can be a better route to the neighbour, and through it */
+  y = linknode[l];
+  if (cost < row[y]) {
+    row[y] = cost;
+    rowvia[y] = slot;
+    changed[nchanged++] = y;
+  }
+  if (cost < old)
+    sendrequest(x, l, NULL, 0);
+
+  if (nchanged > 0) {
+    table_changes += nchanged;
+    lastchange = time;
+    packets_at_lastchange = packets_sent;
+    routeschanged(x, changed, nchanged);
+  }
+  if (nworse > 0)
+    askneighbours(x, l, nworse);
+}
+
+/* the link change before the current one is over */
+static void finishchange(struct linkchange *ch)
+{
+  if (lastchange >= ch->time) {
+    ch->converged = lastchange - ch->time;
+    ch->packets = packets_at_lastchange - ch->packets_before;
+  }
+  else {
+    ch->converged = 0.0;
+    ch->packets = 0;
+  }
+  ch->changes = table_changes - ch->changes_before;
+}
+
+void linkchanged(int i)
+{
+  struct linkchange *ch = &linkchanges[i];
+  int old = linkcost[ch->link];
+  int x;
+
+  if (currentchange >= 0)
+    finishchange(&linkchanges[currentchange]);
+  currentchange = i;
+  ch->packets_before = packets_sent;
+  ch->changes_before = table_changes;
+  if (TRACE>0)
+    printf("time %f: link %d-%d changes cost from %d to %d\n", time, ch->node, ch->neighbour, old, ch->cost);
+  if (ch->cost == old)
+    return;
+
+  linkcost[ch->link] = linkcost[linkrev[ch->link]] = ch->cost;
+  endchanged(ch->node, ch->link, old);
+  endchanged(ch->neighbour, linkrev[ch->link], old);
+
+  /* nodes whose periodic updates stopped once the tables were quiet start again */
+  if (period > 0.0)
+    for (x = 0; x < nnodes; x++)
+      if (!periodic[x]) {
+        periodic[x] = 1;
+        scheduleupdate(x, PERIODIC_UPDATE, period*(0.5 + jimsrand()));
+      }
+}
+
+void reportchanges(void)
+{
+  struct linkchange *ch;
+  int i;
+
+  if (currentchange >= 0)
+    finishchange(&linkchanges[currentchange]);
+  for (i = 0; i < nlinkchanges; i++) {
+    ch = &linkchanges[i];
+    if (ch->cost == INFINITY_COST)
+      printf("link %d-%d down at time %f: ", ch->node, ch->neighbour, ch->time);
+    else
+      printf("link %d-%d cost %d at time %f: ", ch->node, ch->neighbour, ch->cost, ch->time);
+    printf("converged in %f after %ld routing packets, %ld table entries changed, %d destinations counted to infinity\n",
+           ch->converged, ch->packets, ch->changes, ch->counted);
+  }
+}
+
+/* check row x against Dijkstra's shortest paths from x */
+static int verifyrow(int x, int *d, int *heap, int *pos)
+{
+  int n = 0, i, u, v, l, child, parent, tmp, bad = 0;
+
+  for (u = 0; u < nnodes; u++) {
+    d[u] = INFINITY_COST;
+    pos[u] = -1;
+  }
+  d[x] = 0;
+  heap[n] = x;
+  pos[x] = n++;
+  while (n > 0) {
+    u = heap[0];
+    pos[u] = -2;                   /* done */
+    heap[0] = heap[--n];
+    if (n > 0) {
+      pos[heap[0]] = 0;
+      for (i = 0; (child = 2*i + 1) < n; i = child) {
+        if (child + 1 < n && d[heap[child+1]] < d[heap[child]])
+          child++;
+        if (d[heap[child]] >= d[heap[i]])
+          break;
+        tmp = heap[i]; heap[i] = heap[child]; heap[child] = tmp;
+        pos[heap[i]] = i; pos[heap[child]] = child;
+      }
+    }
+    for (l = linkstart[u]; l < linkstart[u+1]; l++) {
+      v = linknode[l];
+      if (pos[v] == -2 || d[u] + linkcost[l] >= d[v])
+        continue;
+      d[v] = d[u] + linkcost[l];
+      if (pos[v] == -1) {
+        heap[n] = v;
+        pos[v] = n++;
+      }
+      for (i = pos[v]; i > 0 && d[heap[parent = (i - 1) / 2]] > d[heap[i]]; i = parent) {
+        tmp = heap[i]; heap[i] = heap[parent]; heap[parent] = tmp;
+        pos[heap[i]] = i; pos[heap[parent]] = parent;
+      }
+    }
+  }
+  for (u = 0; u < nnodes; u++)
+    if (d[u] != dist[(size_t)x*stride + u])
+      bad++;
+  return bad;
+}
+
+void verifytables(void)
+{
+  int *d = allocate(nnodes * sizeof(int));
+  int *heap = allocate(nnodes * sizeof(int));
+  int *pos = allocate(nnodes * sizeof(int));
+  int i, x, bad = 0, checked;
+
+  checked = (nnodes < VERIFYSOURCES) ? nnodes : VERIFYSOURCES;
+  for (i = 0; i < checked; i++) {
+    x = (int)((long)i * nnodes / checked);
+    bad += verifyrow(x, d, heap, pos);
+  }
+  printf("distance tables of %d nodes checked against Dijkstra: %d wrong entries\n", checked, bad);
+  free(d);
+  free(heap);
+  free(pos);
+}
+
+/********************** SIMULATOR ***********************/
+
+void init(void)
+{
+  char file[256], changefile[256];
+  int x, l;
+
+  printf("-----  Distance Vector Routing Simulator -------- \n\n");
+  printf("Enter topology edge list file: ");
+  scanf("%255s", file);
+  printf("Enter packet loss probability [enter 0.0 for no loss]:");
+  scanf("%f", &lossprob);
+  printf("Enter packet corruption probability [0.0 for no corruption]:");
+  scanf("%f", &corruptprob);
+  printf("Enter routes advertised to their next hop: 0 all, 1 split horizon, 2 poison reverse:");
+  scanf("%d", &advertise);
+  printf("Enter time between periodic updates [0.0 for triggered updates only]:");
+  scanf("%f", &period);
+  printf("Enter delay before triggered updates are sent [0.0 to send at once]:");
+  scanf("%f", &holddown);
+  printf("Enter percentage of changed routes above which whole rows are sent [0-100]:");
+  scanf("%d", &densepercent);
+  printf("Enter route cost treated as unreachable [0 for no limit]:");
+  scanf("%d", &maxcost);
+  if (maxcost <= 0 || maxcost > INFINITY_COST)
+    maxcost = INFINITY_COST;
+  printf("Enter link change file [- for none]:");
+  scanf("%255s", changefile);
+  printf("Enter TRACE:");
+  scanf("%d", &TRACE);
+
+  srand(9999);              /* init random number generator */
+  readtopology(file);
+  printf("%d nodes, %d links\n", nnodes, nlinks / 2);
+
+  stride = (nnodes + 7) & ~7;
+  words = (nnodes + 63) / 64;
+  if (posix_memalign((void **)&dist, 32, (size_t)nnodes * stride * sizeof(int)) != 0)
+    dist = NULL;
+  via = malloc((size_t)nnodes * stride * sizeof(unsigned short));
+  changed = malloc(stride * sizeof(int));
+  worsened = malloc(stride * sizeof(int));
+  dirty = calloc((size_t)nnodes * words, sizeof(unsigned long long));
+  triggered = calloc(nnodes, 1);
+  periodic = calloc(nnodes, 1);
+  countedat = malloc(nnodes * sizeof(int));
+  if (dist == 0 || via == 0 || changed == 0 || worsened == 0 || dirty == 0 || triggered == 0
+      || periodic == 0 || countedat == 0) {
+    printf("memory allocation for distance tables failed.");
+    exit(EXIT_FAILURE);
+  }
+
+  /* each node starts knowing only the cost to itself and its neighbours */
+  for (x = 0; x < nnodes; x++) {
+    for (l = 0; l < stride; l++) {
+      dist[(size_t)x*stride + l] = INFINITY_COST;
+      via[(size_t)x*stride + l] = MAXNEIGHBOURS;
+    }
+    dist[(size_t)x*stride + x] = 0;
+    countedat[x] = -1;
+    for (l = linkstart[x]; l < linkstart[x+1]; l++) {
+      dist[(size_t)x*stride + linknode[l]] = linkcost[l];
+      via[(size_t)x*stride + linknode[l]] = l - linkstart[x];
+    }
+  }
+
+  time = 0.0;
+  lastchange = 0.0;
+  for (x = 0; x < nnodes; x++) {
+    changed[0] = x;
+    for (l = linkstart[x]; l < linkstart[x+1]; l++)
+      changed[l - linkstart[x] + 1] = linknode[l];
+    sendupdate(x, changed, linkstart[x+1] - linkstart[x] + 1);
+    if (period > 0.0) {    /* spread the nodes' periodic updates over the period */
+      scheduleupdate(x, PERIODIC_UPDATE, period*(0.5 + jimsrand()));
+      periodic[x] = 1;
+    }
+  }
+
+  if (strcmp(changefile, "-") != 0)
+    readchanges(changefile);
+}
+
+int main(void)
+{
+  struct event *eventptr;
+
+  init();
+
+  while ((eventptr = takeevent()) != NULL) {
+    time = eventptr->evtime;        /* update time to next event time */
+    if (eventptr->evtype == FROM_LAYER2) {
+      rtupdate(eventptr->evnode, eventptr->pktptr);
+      freepkt(eventptr->pktptr);
+    }
+    else if (eventptr->evtype == TRIGGERED_UPDATE)
+      sendtriggered(eventptr->evnode);
+    else if (eventptr->evtype == PERIODIC_UPDATE) {
+      /* keep refreshing neighbours until the tables have been quiet a while */
+      if (time - lastchange < QUIETPERIODS * period) {
+        sendupdate(eventptr->evnode, NULL, 0);
+        scheduleupdate(eventptr->evnode, PERIODIC_UPDATE, period*(0.5 + jimsrand()));
+      }
+      else
+        periodic[eventptr->evnode] = 0;
+    }
+    else if (eventptr->evtype == LINK_CHANGE)
+      linkchanged(eventptr->evchange);
+    else
+      printf("INTERNAL PANIC: unknown event type \n");
+    free(eventptr);
+  }
+
+  printf(" Simulator terminated at time %f\n", time);
+  printf("routing converged at time %f after %ld routing packets\n", lastchange, packets_at_lastchange);
+  printf("number of routing packets sent:  %ld (%ld entries)\n", packets_sent, entries_sent);
+  printf("number of routing packets lost:  %ld \n", packets_lost);
+  printf("number of corrupted routing packets discarded:  %ld \n", packets_corrupt);
+  printf("number of distance table entries changed:  %ld \n", table_changes);
+  reportchanges();
+  verifytables();
+  return EXIT_SUCCESS;
+}
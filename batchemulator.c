@@ -0,0 +1,790 @@
+/* ***** BATCH ENGINE: MANY GBN/SR REPLICATIONS IN LOCKSTEP *************
+   Averages of the protocols need many independent runs of the emulator,
+   which spends most of its time allocating events and walking the event
+   list of one replication at a time.  This file runs the GBN protocol of
+   gbn.c or the SR protocol of sr.c (window 6, 20 byte payloads, none of
+   the options) for many replications at once, LANES at a time:
+
+     gcc -O2 -march=native -ffp-contract=off -o batch batchemulator.c
+     gcc -O2 -ffp-contract=off -o batch batchemulator.c   (lane by lane)
+
+   Both builds give the same results, bit for bit.  That needs
+   -ffp-contract=off: otherwise, where FMA is available, the compiler may
+   fuse the delay computed lane by lane for a timeout into one rounding,
+   while the AVX2 path rounds the multiply and the add separately.
+
+   - the state of LANES replications is kept in a block, as arrays with
+   one entry per lane.  A lane that finishes its replication starts the
+   next one, so a long replication doesn't hold up the others.
+   - a replication has at most four pending events: the next message from
+   layer 5, A's timer and the head packet of the medium in each
+   direction.  Each step takes the earliest event of every lane.
+   - the random draws, the choice of event, the checksum of each packet
+   that arrives, the sliding of A's window on an ACK and the loss, delay
+   and corruption of each packet sent are done for all the lanes together
+   with AVX2 when it is available, otherwise lane by lane.  Only the
+   branchy parts (messages, timeouts and B) are always done lane by lane.
+   - each lane has its own xorshift generator, and draws the numbers any
+   event could need at every step, so the lanes stay in step.
+   - a packet is kept as its header, the sum of its payload and its
+   checksum, so the 'Z' that tolayer3 writes over the first payload byte
+   changes the sum as it would the payload.
+
+   The protocols and the medium follow gbn.c, sr.c and emulator.c with
+   the uniform arrival process, so averages agree with the emulator's,
+   but the random numbers differ and so do single runs.  Events at the
+   same time are taken in a fixed order instead of newest first.
+   ********************************************************************* */
+
+#define _POSIX_C_SOURCE 199309L   /* clock_gettime */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define  LANES      8          /* replications per block, one per AVX2 lane */
+#define  DRAWS      5          /* random numbers each lane draws per step */
+#define  RTT        16.0f      /* as in gbn.c and sr.c */
+#define  WINDOWSIZE 6
+#define  GBNSEQ     7          /* sequence spaces of gbn.c and sr.c */
+#define  SRSEQ      12
+#define  NOTINUSE   (-1)
+#define  PAYLOAD    20         /* bytes of payload, all the same letter */
+#define  NEVER      1e30f      /* time of an event that is not pending */
+#define  FIRSTSLOTS 16         /* packets each lane's medium first holds, a power of 2 */
+
+#define  A    0
+#define  B    1
+#define  GBN  0
+#define  SR   1
+
+/* the next event of a lane */
+enum { EV_NONE = -1, EV_MESSAGE, EV_TIMER, EV_TOB, EV_TOA };
+
+struct channel {              /* one direction of the medium, for each lane */
+  int head[LANES];            /* slot of the packet that arrives next */
+  int len[LANES];             /* packets on their way */
+  float last[LANES];          /* latest arrival, so the medium can't reorder */
+  int slots;                  /* slots per lane, a power of 2 */
+  float *time;                /* slots rows of LANES entries: arrival time */
+  int *seq, *ack;             /* header */
+  int *sum;                   /* sum of the payload */
+  int *check;                 /* checksum */
+};
+
+struct block {                /* LANES replications, one per lane */
+  int rep[LANES];             /* replication in the lane, -1 once there are none left */
+  float now[LANES];
+  float nextmsg[LANES];       /* next message from layer 5, or NEVER */
+  float timer[LANES];         /* A's timer, or NEVER */
+  int nsim[LANES];            /* messages generated */
+  /* sender: the window holds count packets from slot first, the oldest
+     has sequence number base */
+  int first[LANES], count[LANES], base[LANES], nextseq[LANES];
+  int acked[LANES];           /* SR: bit s set once sequence number s is ACKed */
+  int byte[WINDOWSIZE][LANES];  /* payload letter of each window slot */
+  /* receiver */
+  int expect[LANES];          /* GBN: expected sequence number, SR: window base */
+  int received[LANES];        /* SR: bit s set when s is buffered */
+  int bnext[LANES];           /* sequence number of B's next ACK */
+  uint32_t rng[4][LANES];     /* xorshift128 state */
+  struct channel ch[2];       /* packets sent by A and by B */
+  /* statistics */
+  int window_full[LANES], new_ACKs[LANES], packets_resent[LANES];
+  int packets_received[LANES], messages_delivered[LANES];
+};
+
+struct outgoing {             /* the packet each lane sends in a step */
+  int sender[LANES];          /* A, B, or -1 for none */
+  int seq[LANES], ack[LANES];
+  int byte[LANES];            /* payload letter */
+};
+
+static int protocol;
+static int seqspace;
+static int nreps;             /* replications to run */
+static int nsimmax;           /* messages in each */
+static float lossprob, corruptprob;
+static int corruptdirection = 2;  /* 0 A->B, 1 A<-B, 2 both */
+static float lambda;
+
+/********************* random numbers ***********************************/
+
+/* the next number of lane i's generator */
+static uint32_t xorshift(struct block *k, int i)
+{
+  uint32_t t = k->rng[0][i] ^ (k->rng[0][i] << 11);
+
+  k->rng[0][i] = k->rng[1][i];
+  k->rng[1][i] = k->rng[2][i];
+  k->rng[2][i] = k->rng[3][i];
+  k->rng[3][i] ^= (k->rng[3][i] >> 19) ^ t ^ (t >> 8);
+  return k->rng[3][i];
+}
+
+/* uniform on [0,1) for lane i */
+static float uniform(struct block *k, int i)
+{
+  return (xorshift(k, i) >> 8) * (1.0f / 16777216.0f);
+}
+
+/* seed lane i from the number of its replication */
+static void seed(struct block *k, int i, int rep)
+{
+  uint64_t z;
+  int j;
+
+  for (j = 0; j < 4; j++) {
+    z = ((uint64_t)rep * 4 + j + 1) * 0x9E3779B97F4A7C15ULL;       /* splitmix64 */
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    k->rng[j][i] = (uint32_t)(z ^ (z >> 31)) | (j == 0);  /* never all zero */
+  }
+}
+
+/* DRAWS numbers for every lane */
+static void draw(struct block *k, float u[DRAWS][LANES])
+{
+  int d;
+#ifdef __AVX2__
+  __m256i s0 = _mm256_loadu_si256((const __m256i *)k->rng[0]);
+  __m256i s1 = _mm256_loadu_si256((const __m256i *)k->rng[1]);
+  __m256i s2 = _mm256_loadu_si256((const __m256i *)k->rng[2]);
+  __m256i s3 = _mm256_loadu_si256((const __m256i *)k->rng[3]);
+  __m256 scale = _mm256_set1_ps(1.0f / 16777216.0f);
+  __m256i t;
+
+  for (d = 0; d < DRAWS; d++) {
+    t = _mm256_xor_si256(s0, _mm256_slli_epi32(s0, 11));
+    s0 = s1;
+    s1 = s2;
+    s2 = s3;
+    s3 = _mm256_xor_si256(_mm256_xor_si256(s3, _mm256_srli_epi32(s3, 19)),
+                          _mm256_xor_si256(t, _mm256_srli_epi32(t, 8)));
+    _mm256_storeu_ps(u[d], _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(s3, 8)), scale));
+  }
+  _mm256_storeu_si256((__m256i *)k->rng[0], s0);
+  _mm256_storeu_si256((__m256i *)k->rng[1], s1);
+  _mm256_storeu_si256((__m256i *)k->rng[2], s2);
+  _mm256_storeu_si256((__m256i *)k->rng[3], s3);
+#else
+  int i;
+
+  for (d = 0; d < DRAWS; d++)
+    for (i = 0; i < LANES; i++)
+      u[d][i] = uniform(k, i);
+#endif
+}
+
+/********************* the medium ***************************************/
+
+static void *allocate(size_t size)
+{
+  void *p = malloc(size);
+
+  if (p == NULL) {
+    fprintf(stderr, "Out of memory for the medium\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static void openchannel(struct channel *c, int slots)
+{
+  c->slots = slots;
+  c->time = allocate(sizeof(float) * slots * LANES);
+  c->seq = allocate(sizeof(int) * slots * LANES);
+  c->ack = allocate(sizeof(int) * slots * LANES);
+  c->sum = allocate(sizeof(int) * slots * LANES);
+  c->check = allocate(sizeof(int) * slots * LANES);
+}
+
+static void closechannel(struct channel *c)
+{
+  free(c->time);
+  free(c->seq);
+  free(c->ack);
+  free(c->sum);
+  free(c->check);
+}
+
+/* double the slots of a channel, moving each lane's packets to its first slots */
+static void growchannel(struct channel *c)
+{
+  struct channel old = *c;
+  int i, j, from, to;
+
+  openchannel(c, 2 * old.slots);
+  for (i = 0; i < LANES; i++) {
+    for (j = 0; j < old.len[i]; j++) {
+      from = ((old.head[i] + j) & (old.slots - 1)) * LANES + i;
+      to = j * LANES + i;
+      c->time[to] = old.time[from];
+      c->seq[to] = old.seq[from];
+      c->ack[to] = old.ack[from];
+      c->sum[to] = old.sum[from];
+      c->check[to] = old.check[from];
+    }
+    c->head[i] = 0;
+  }
+  closechannel(&old);
+}
+
+/* put a packet on lane i of a channel */
+static void push(struct channel *c, int i, float time, int seq, int ack, int sum, int check)
+{
+  int j;
+
+  if (c->len[i] == c->slots)
+    growchannel(c);
+  j = ((c->head[i] + c->len[i]++) & (c->slots - 1)) * LANES + i;
+  c->time[j] = time;
+  c->seq[j] = seq;
+  c->ack[j] = ack;
+  c->sum[j] = sum;
+  c->check[j] = check;
+}
+
+/* loss and corruption can be restricted to one direction */
+static int affected(int sender)
+{
+  return corruptdirection == 2 || corruptdirection == sender;
+}
+
+/* tolayer3 for lane i, given the four numbers drawn for the packet */
+static void transmit(struct block *k, int i, int sender, int seq, int ack, int byte, const float u[4])
+{
+  struct channel *c = &k->ch[sender];
+  int sum = PAYLOAD * byte;
+  int check = seq + ack + sum;
+  float lastime;
+
+  if (u[0] < lossprob && affected(sender))
+    return;
+
+  /* the same operations in the same order as in transmitall */
+  lastime = (c->last[i] > k->now[i]) ? c->last[i] : k->now[i];
+  c->last[i] = (lastime + 1.0f) + 9.0f * u[1];
+
+  if (u[2] < corruptprob && affected(sender)) {
+    if (u[3] < .75f)
+      sum += 'Z' - byte;        /* corrupt payload */
+    else if (u[3] < .875f)
+      seq = 999999;
+    else
+      ack = 999999;
+  }
+  push(c, i, c->last[i], seq, ack, sum, check);
+}
+
+/* tolayer3 for the packet each lane has in o, using draws 1 to 4 */
+static void transmitall(struct block *k, const struct outgoing *o, float u[DRAWS][LANES])
+{
+  int i;
+#ifdef __AVX2__
+  __m256i zero = _mm256_setzero_si256();
+  __m256i sender = _mm256_loadu_si256((const __m256i *)o->sender);
+  __m256i froma = _mm256_cmpeq_epi32(sender, zero);
+  __m256i fromb = _mm256_cmpeq_epi32(sender, _mm256_set1_epi32(B));
+  __m256 any = _mm256_castsi256_ps(_mm256_or_si256(froma, fromb));
+  __m256 hit = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(froma, _mm256_set1_epi32(-affected(A))),
+                                                   _mm256_and_si256(fromb, _mm256_set1_epi32(-affected(B)))));
+  __m256 lasta = _mm256_loadu_ps(k->ch[A].last);
+  __m256 lastb = _mm256_loadu_ps(k->ch[B].last);
+  __m256 last, keep, bad, pay, notack;
+  __m256i seq, ack, byte, sum, check;
+  float arrive[LANES];
+  int seqs[LANES], acks[LANES], sums[LANES], checks[LANES];
+  int mask;
+
+  /* loss */
+  keep = _mm256_andnot_ps(_mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(u[1]), _mm256_set1_ps(lossprob), _CMP_LT_OQ), hit), any);
+  mask = _mm256_movemask_ps(keep);
+  if (mask == 0)
+    return;
+
+  /* arrival after the latest packet on the way in the same direction */
+  last = _mm256_blendv_ps(lasta, lastb, _mm256_castsi256_ps(fromb));
+  last = _mm256_add_ps(_mm256_add_ps(_mm256_max_ps(last, _mm256_loadu_ps(k->now)), _mm256_set1_ps(1.0f)),
+                       _mm256_mul_ps(_mm256_set1_ps(9.0f), _mm256_loadu_ps(u[2])));
+  _mm256_storeu_ps(k->ch[A].last, _mm256_blendv_ps(lasta, last, _mm256_and_ps(keep, _mm256_castsi256_ps(froma))));
+  _mm256_storeu_ps(k->ch[B].last, _mm256_blendv_ps(lastb, last, _mm256_and_ps(keep, _mm256_castsi256_ps(fromb))));
+  _mm256_storeu_ps(arrive, last);
+
+  /* checksum, then corruption */
+  seq = _mm256_loadu_si256((const __m256i *)o->seq);
+  ack = _mm256_loadu_si256((const __m256i *)o->ack);
+  byte = _mm256_loadu_si256((const __m256i *)o->byte);
+  sum = _mm256_mullo_epi32(byte, _mm256_set1_epi32(PAYLOAD));
+  check = _mm256_add_epi32(_mm256_add_epi32(seq, ack), sum);
+  bad = _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(u[3]), _mm256_set1_ps(corruptprob), _CMP_LT_OQ), hit);
+  pay = _mm256_and_ps(bad, _mm256_cmp_ps(_mm256_loadu_ps(u[4]), _mm256_set1_ps(.75f), _CMP_LT_OQ));
+  notack = _mm256_cmp_ps(_mm256_loadu_ps(u[4]), _mm256_set1_ps(.875f), _CMP_LT_OQ);
+  sum = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(sum),
+          _mm256_castsi256_ps(_mm256_sub_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32('Z')), byte)), pay));
+  seq = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(seq), _mm256_castsi256_ps(_mm256_set1_epi32(999999)),
+                                             _mm256_andnot_ps(pay, _mm256_and_ps(bad, notack))));
+  ack = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(ack), _mm256_castsi256_ps(_mm256_set1_epi32(999999)),
+                                             _mm256_andnot_ps(notack, bad)));
+  _mm256_storeu_si256((__m256i *)seqs, seq);
+  _mm256_storeu_si256((__m256i *)acks, ack);
+  _mm256_storeu_si256((__m256i *)sums, sum);
+  _mm256_storeu_si256((__m256i *)checks, check);
+
+  /* each lane's slot is different, so the packets are stored one by one */
+  while (mask != 0) {
+    i = __builtin_ctz(mask);
+    push(&k->ch[o->sender[i]], i, arrive[i], seqs[i], acks[i], sums[i], checks[i]);
+    mask &= mask - 1;
+  }
+#else
+  float v[4];
+  int d;
+
+  for (i = 0; i < LANES; i++) {
+    if (o->sender[i] < 0)
+      continue;
+    for (d = 0; d < 4; d++)
+      v[d] = u[d + 1][i];
+    transmit(k, i, o->sender[i], o->seq[i], o->ack[i], o->byte[i], v);
+  }
+#endif
+}
+
+/********************* events *******************************************/
+
+/* pick the earliest event of each lane and move its clock there.
+   Returns a bit for each lane that has one */
+static int nextevents(struct block *k, int type[LANES])
+{
+  int i;
+#ifdef __AVX2__
+  __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256 never = _mm256_set1_ps(NEVER);
+  __m256 msg = _mm256_loadu_ps(k->nextmsg);
+  __m256 timer = _mm256_loadu_ps(k->timer);
+  __m256 head[2], t, live;
+  __m256i idx, ev;
+
+  for (i = A; i <= B; i++) {
+    idx = _mm256_add_epi32(_mm256_slli_epi32(_mm256_loadu_si256((const __m256i *)k->ch[i].head), 3), lane);
+    head[i] = _mm256_mask_i32gather_ps(never, k->ch[i].time, idx,
+        _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)k->ch[i].len), _mm256_setzero_si256())), 4);
+  }
+  t = _mm256_min_ps(_mm256_min_ps(msg, timer), _mm256_min_ps(head[A], head[B]));
+  ev = _mm256_set1_epi32(EV_TOA);
+  ev = _mm256_blendv_epi8(ev, _mm256_set1_epi32(EV_TOB), _mm256_castps_si256(_mm256_cmp_ps(t, head[A], _CMP_EQ_OQ)));
+  ev = _mm256_blendv_epi8(ev, _mm256_set1_epi32(EV_TIMER), _mm256_castps_si256(_mm256_cmp_ps(t, timer, _CMP_EQ_OQ)));
+  ev = _mm256_blendv_epi8(ev, _mm256_set1_epi32(EV_MESSAGE), _mm256_castps_si256(_mm256_cmp_ps(t, msg, _CMP_EQ_OQ)));
+  live = _mm256_cmp_ps(t, never, _CMP_LT_OQ);
+  ev = _mm256_blendv_epi8(_mm256_set1_epi32(EV_NONE), ev, _mm256_castps_si256(live));
+  _mm256_storeu_si256((__m256i *)type, ev);
+  _mm256_storeu_ps(k->now, _mm256_blendv_ps(_mm256_loadu_ps(k->now), t, live));
+  return _mm256_movemask_ps(live);
+#else
+  float head[2], t;
+  int s, live = 0;
+
+  for (i = 0; i < LANES; i++) {
+    for (s = A; s <= B; s++)
+      head[s] = (k->ch[s].len[i] > 0) ? k->ch[s].time[k->ch[s].head[i] * LANES + i] : NEVER;
+    t = k->nextmsg[i];
+    type[i] = EV_MESSAGE;
+    if (k->timer[i] < t) {
+      t = k->timer[i];
+      type[i] = EV_TIMER;
+    }
+    if (head[A] < t) {
+      t = head[A];
+      type[i] = EV_TOB;
+    }
+    if (head[B] < t) {
+      t = head[B];
+      type[i] = EV_TOA;
+    }
+    if (t < NEVER) {
+      k->now[i] = t;
+      live |= 1 << i;
+    }
+    else
+      type[i] = EV_NONE;
+  }
+  return live;
+#endif
+}
+
+/* take the head packet off the medium of each lane whose event is an
+   arrival, and check its checksum */
+static void arrivals(struct block *k, const int type[LANES], int seq[LANES], int ack[LANES], int bad[LANES])
+{
+  int i;
+#ifdef __AVX2__
+  __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i zero = _mm256_setzero_si256();
+  __m256i ev = _mm256_loadu_si256((const __m256i *)type);
+  __m256i vseq = zero, vack = zero, vbad = zero;
+  __m256i m, idx, head, s, a, sum, check;
+  struct channel *c;
+
+  for (i = A; i <= B; i++) {
+    c = &k->ch[i];
+    m = _mm256_cmpeq_epi32(ev, _mm256_set1_epi32(i == A ? EV_TOB : EV_TOA));
+    if (_mm256_testz_si256(m, m))
+      continue;
+    head = _mm256_loadu_si256((const __m256i *)c->head);
+    idx = _mm256_add_epi32(_mm256_slli_epi32(head, 3), lane);
+    s = _mm256_mask_i32gather_epi32(zero, c->seq, idx, m, 4);
+    a = _mm256_mask_i32gather_epi32(zero, c->ack, idx, m, 4);
+    sum = _mm256_mask_i32gather_epi32(zero, c->sum, idx, m, 4);
+    check = _mm256_mask_i32gather_epi32(zero, c->check, idx, m, 4);
+    vseq = _mm256_blendv_epi8(vseq, s, m);
+    vack = _mm256_blendv_epi8(vack, a, m);
+    vbad = _mm256_or_si256(vbad, _mm256_andnot_si256(
+             _mm256_cmpeq_epi32(_mm256_add_epi32(_mm256_add_epi32(s, a), sum), check), m));
+    /* m is -1 in the lanes taking a packet */
+    _mm256_storeu_si256((__m256i *)c->head,
+                        _mm256_and_si256(_mm256_sub_epi32(head, m), _mm256_set1_epi32(c->slots - 1)));
+    _mm256_storeu_si256((__m256i *)c->len, _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)c->len), m));
+  }
+  _mm256_storeu_si256((__m256i *)seq, vseq);
+  _mm256_storeu_si256((__m256i *)ack, vack);
+  _mm256_storeu_si256((__m256i *)bad, _mm256_and_si256(vbad, _mm256_set1_epi32(1)));
+#else
+  struct channel *c;
+  int j;
+
+  for (i = 0; i < LANES; i++) {
+    seq[i] = ack[i] = bad[i] = 0;
+    if (type[i] != EV_TOB && type[i] != EV_TOA)
+      continue;
+    c = &k->ch[(type[i] == EV_TOB) ? A : B];
+    j = c->head[i] * LANES + i;
+    seq[i] = c->seq[j];
+    ack[i] = c->ack[j];
+    bad[i] = (c->seq[j] + c->ack[j] + c->sum[j] != c->check[j]);
+    c->head[i] = (c->head[i] + 1) & (c->slots - 1);
+    c->len[i]--;
+  }
+#endif
+}
+
+/* A_input for each lane whose event is an ACK: slide the window, and
+   restart or stop the timer */
+static void acks(struct block *k, const int type[LANES], const int ack[LANES], const int bad[LANES])
+{
+  int i;
+#ifdef __AVX2__
+  __m256i zero = _mm256_setzero_si256();
+  __m256i one = _mm256_set1_epi32(1);
+  __m256i space = _mm256_set1_epi32(seqspace);
+  __m256i size = _mm256_set1_epi32(WINDOWSIZE);
+  __m256i a = _mm256_loadu_si256((const __m256i *)ack);
+  __m256i base = _mm256_loadu_si256((const __m256i *)k->base);
+  __m256i count = _mm256_loadu_si256((const __m256i *)k->count);
+  __m256i first = _mm256_loadu_si256((const __m256i *)k->first);
+  __m256i m, d, n, acked, bit, run, s;
+  __m256 timer;
+
+  m = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)bad), one),
+                          _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)type), _mm256_set1_epi32(EV_TOA)));
+  if (_mm256_testz_si256(m, m))
+    return;
+
+  /* how far the ACK is from the oldest packet in the window */
+  d = _mm256_sub_epi32(a, base);
+  d = _mm256_add_epi32(d, _mm256_and_si256(_mm256_cmpgt_epi32(zero, d), space));
+  m = _mm256_and_si256(m, _mm256_cmpgt_epi32(count, d));
+
+  if (protocol == GBN)
+    /* cumulative: everything up to the ACK is done */
+    n = _mm256_and_si256(_mm256_add_epi32(d, one), m);
+  else {
+    /* the first ACK of a packet marks it, and one for the oldest slides
+       the window past the marked packets */
+    acked = _mm256_loadu_si256((const __m256i *)k->acked);
+    bit = _mm256_sllv_epi32(one, a);
+    m = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(acked, bit), bit), m);
+    acked = _mm256_or_si256(acked, _mm256_and_si256(bit, m));
+    _mm256_storeu_si256((__m256i *)k->acked, acked);
+    _mm256_storeu_si256((__m256i *)k->new_ACKs,
+                        _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)k->new_ACKs), m));
+    m = _mm256_and_si256(m, _mm256_cmpeq_epi32(d, zero));
+    n = zero;
+    run = m;
+    for (i = 0; i < WINDOWSIZE; i++) {
+      s = _mm256_add_epi32(base, n);
+      s = _mm256_sub_epi32(s, _mm256_and_si256(_mm256_cmpgt_epi32(s, _mm256_set1_epi32(seqspace - 1)), space));
+      run = _mm256_and_si256(run, _mm256_and_si256(_mm256_cmpgt_epi32(count, n),
+                                                   _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_srlv_epi32(acked, s), one), one)));
+      n = _mm256_sub_epi32(n, run);
+    }
+  }
+
+  first = _mm256_add_epi32(first, n);
+  first = _mm256_sub_epi32(first, _mm256_and_si256(_mm256_cmpgt_epi32(first, _mm256_set1_epi32(WINDOWSIZE - 1)), size));
+  base = _mm256_add_epi32(base, n);
+  base = _mm256_sub_epi32(base, _mm256_and_si256(_mm256_cmpgt_epi32(base, _mm256_set1_epi32(seqspace - 1)), space));
+  count = _mm256_sub_epi32(count, n);
+  _mm256_storeu_si256((__m256i *)k->first, first);
+  _mm256_storeu_si256((__m256i *)k->base, base);
+  _mm256_storeu_si256((__m256i *)k->count, count);
+  if (protocol == GBN)
+    _mm256_storeu_si256((__m256i *)k->new_ACKs,
+                        _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)k->new_ACKs), m));
+
+  /* start the timer again if packets are still unacked */
+  timer = _mm256_blendv_ps(_mm256_set1_ps(NEVER), _mm256_add_ps(_mm256_loadu_ps(k->now), _mm256_set1_ps(RTT)),
+                           _mm256_castsi256_ps(_mm256_cmpgt_epi32(count, zero)));
+  _mm256_storeu_ps(k->timer, _mm256_blendv_ps(_mm256_loadu_ps(k->timer), timer, _mm256_castsi256_ps(m)));
+#else
+  int d, n;
+
+  for (i = 0; i < LANES; i++) {
+    if (type[i] != EV_TOA || bad[i])
+      continue;
+    d = ack[i] - k->base[i];
+    if (d < 0)
+      d += seqspace;
+    if (d >= k->count[i])
+      continue;                 /* duplicate */
+    if (protocol == GBN)
+      n = d + 1;
+    else {
+      if (k->acked[i] & (1 << ack[i]))
+        continue;
+      k->acked[i] |= 1 << ack[i];
+      k->new_ACKs[i]++;
+      if (d != 0)
+        continue;
+      for (n = 0; n < k->count[i] && (k->acked[i] & (1 << ((k->base[i] + n) % seqspace))); n++)
+        ;
+    }
+    k->first[i] = (k->first[i] + n) % WINDOWSIZE;
+    k->base[i] = (k->base[i] + n) % seqspace;
+    k->count[i] -= n;
+    if (protocol == GBN)
+      k->new_ACKs[i]++;
+    k->timer[i] = (k->count[i] > 0) ? k->now[i] + RTT : NEVER;
+  }
+#endif
+}
+
+/* a message from layer 5 for lane i, and A_output */
+static void message(struct block *k, int i, float u, struct outgoing *o)
+{
+  int slot;
+
+  if (k->nsim[i] >= nsimmax) {
+    k->nextmsg[i] = NEVER;
+    return;
+  }
+  k->nextmsg[i] = k->now[i] + lambda * u * 2;
+  o->byte[i] = 'a' + k->nsim[i]++ % 26;
+
+  if (k->count[i] == WINDOWSIZE) {
+    k->window_full[i]++;
+    return;
+  }
+  slot = (k->first[i] + k->count[i]) % WINDOWSIZE;
+  k->byte[slot][i] = o->byte[i];
+  o->sender[i] = A;
+  o->seq[i] = k->nextseq[i];
+  o->ack[i] = NOTINUSE;
+  k->acked[i] &= ~(1 << k->nextseq[i]);
+  if (++k->count[i] == 1)
+    k->timer[i] = k->now[i] + RTT;
+  k->nextseq[i] = (k->nextseq[i] + 1) % seqspace;
+}
+
+/* A_timerinterrupt for lane i: GBN sends the whole window again, SR the
+   oldest packet */
+static void timeout(struct block *k, int i)
+{
+  float u[4];
+  int j, d, n;
+
+  k->timer[i] = NEVER;
+  n = (protocol == GBN) ? k->count[i] : (k->count[i] > 0);
+  for (j = 0; j < n; j++) {
+    for (d = 0; d < 4; d++)
+      u[d] = uniform(k, i);
+    transmit(k, i, A, (k->base[i] + j) % seqspace, NOTINUSE, k->byte[(k->first[i] + j) % WINDOWSIZE][i], u);
+    k->packets_resent[i]++;
+  }
+  if (n > 0)
+    k->timer[i] = k->now[i] + RTT;
+}
+
+/* B_input for lane i */
+static void receive(struct block *k, int i, int seq, int bad, struct outgoing *o)
+{
+  if (protocol == GBN) {
+    if (!bad && seq == k->expect[i]) {
+      k->packets_received[i]++;
+      k->messages_delivered[i]++;
+      o->ack[i] = k->expect[i];
+      k->expect[i] = (k->expect[i] + 1) % seqspace;
+    }
+    else
+      o->ack[i] = (k->expect[i] + seqspace - 1) % seqspace;  /* resend last ACK */
+  }
+  else {
+    if (bad)
+      return;
+    k->packets_received[i]++;
+    if ((seq - k->expect[i] + seqspace) % seqspace < WINDOWSIZE) {
+      k->received[i] |= 1 << seq;
+      while (k->received[i] & (1 << k->expect[i])) {
+        k->received[i] &= ~(1 << k->expect[i]);
+        k->messages_delivered[i]++;
+        k->expect[i] = (k->expect[i] + 1) % seqspace;
+      }
+    }
+    o->ack[i] = seq;
+  }
+  o->sender[i] = B;
+  o->seq[i] = k->bnext[i];
+  o->byte[i] = '0';
+  k->bnext[i] ^= 1;
+}
+
+/* one event for every lane of the block.  Returns a bit for each lane
+   that had one */
+static int step(struct block *k)
+{
+  float u[DRAWS][LANES];
+  int type[LANES], seq[LANES], ack[LANES], bad[LANES];
+  struct outgoing o;
+  int i, live;
+
+  live = nextevents(k, type);
+  if (live == 0)
+    return 0;
+  draw(k, u);
+  arrivals(k, type, seq, ack, bad);
+  for (i = 0; i < LANES; i++) {
+    o.sender[i] = -1;
+    if (type[i] == EV_MESSAGE)
+      message(k, i, u[0][i], &o);
+    else if (type[i] == EV_TIMER)
+      timeout(k, i);
+    else if (type[i] == EV_TOB)
+      receive(k, i, seq[i], bad[i], &o);
+  }
+  acks(k, type, ack, bad);
+  transmitall(k, &o, u);
+  return live;
+}
+
+/* start replication rep in lane i, or leave the lane with no events if
+   rep is -1 */
+static void startlane(struct block *k, int i, int rep)
+{
+  int s;
+
+  k->rep[i] = rep;
+  seed(k, i, rep);
+  k->now[i] = 0.0f;
+  k->nextmsg[i] = (rep >= 0) ? lambda * uniform(k, i) * 2 : NEVER;
+  k->timer[i] = NEVER;
+  k->nsim[i] = 0;
+  k->first[i] = k->count[i] = k->base[i] = k->nextseq[i] = k->acked[i] = 0;
+  k->expect[i] = k->received[i] = 0;
+  k->bnext[i] = 1;
+  for (s = A; s <= B; s++) {
+    k->ch[s].head[i] = k->ch[s].len[i] = 0;
+    k->ch[s].last[i] = 0.0f;
+  }
+  k->window_full[i] = k->new_ACKs[i] = k->packets_resent[i] = 0;
+  k->packets_received[i] = k->messages_delivered[i] = 0;
+}
+
+/* add the statistics of lane i's finished replication to the totals */
+static void finishlane(struct block *k, int i, double totals[6])
+{
+  totals[0] += k->now[i];
+  totals[1] += k->window_full[i];
+  totals[2] += k->new_ACKs[i];
+  totals[3] += k->packets_resent[i];
+  totals[4] += k->packets_received[i];
+  totals[5] += k->messages_delivered[i];
+}
+
+static void init(void)
+{
+  printf("-----  Batch Network Simulator -------- \n\n");
+  printf("Enter protocol: 0 GBN, 1 SR:");
+  scanf("%d",&protocol);
+  printf("Enter the number of replications:");
+  scanf("%d",&nreps);
+  printf("Enter the number of messages to simulate: ");
+  scanf("%d",&nsimmax);
+  printf("Enter  packet loss probability [enter 0.0 for no loss]:");
+  scanf("%f",&lossprob);
+  printf("Enter packet corruption probability [0.0 for no corruption]:");
+  scanf("%f",&corruptprob);
+  if (lossprob > 0.0 || corruptprob > 0.0) {
+    printf("If you want loss or corruption to only occur in one direction, choose the direction: 0 A->B, 1 A<-B, 2 A<->B (both directions) :");
+    scanf("%d",&corruptdirection);
+  }
+  printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
+  scanf("%f",&lambda);
+  seqspace = (protocol == GBN) ? GBNSEQ : SRSEQ;
+  if (nreps < 1)
+    nreps = 1;
+}
+
+int main(void)
+{
+  struct block k;
+  struct timespec start, stop;
+  double totals[6] = {0};
+  double elapsed;
+  int next = 0, finished = 0;
+  int live, i;
+
+  init();
+  openchannel(&k.ch[A], FIRSTSLOTS);
+  openchannel(&k.ch[B], FIRSTSLOTS);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < LANES; i++)
+    startlane(&k, i, (next < nreps) ? next++ : -1);
+  /* a lane with no event has finished its replication, and takes the
+     next one at once rather than waiting for the rest of the block */
+  while (finished < nreps) {
+    live = step(&k);
+    for (i = 0; i < LANES; i++)
+      if (!(live & (1 << i)) && k.rep[i] >= 0) {
+        finishlane(&k, i, totals);
+        finished++;
+        startlane(&k, i, (next < nreps) ? next++ : -1);
+      }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf(" Ran %d %s replications of %d msgs from layer5 in %f s, %d at a time (%s)\n",
+         nreps, (protocol == GBN) ? "GBN" : "SR", nsimmax, elapsed, LANES,
+#ifdef __AVX2__
+         "AVX2"
+#else
+         "lane by lane"
+#endif
+         );
+  printf("replications per second:  %.1f \n", nreps / elapsed);
+  printf("Averages over the replications:\n");
+  printf("time the simulator terminated at:  %f \n", totals[0] / nreps);
+  printf("number of messages dropped due to full window:  %f \n", totals[1] / nreps);
+  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %f \n", totals[2] / nreps);
+  printf("number of packet resends by A:  %f \n", totals[3] / nreps);
+  printf("number of correct packets received at B:  %f \n", totals[4] / nreps);
+  printf("number of messages delivered to application:  %f \n", totals[5] / nreps);
+
+  closechannel(&k.ch[A]);
+  closechannel(&k.ch[B]);
+  return EXIT_SUCCESS;
+}
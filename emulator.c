@@ -39,21 +39,194 @@
 #include "emulator.h"
 #include "gbn.h"
 
+/* compile with -DNETLOG=1 to add the network event record/replay option:
+   in record mode every network decision (message arrival gaps, packet
+   loss, channel delay and corruption) is written to a binary log; in
+   replay mode the decisions are read back from the log instead of being
+   drawn from the random number generator, so any protocol implementation
+   sees exactly the same network.  A replay that needs more decisions
+   than were recorded stops with an error.  */
+#ifndef NETLOG
+#define NETLOG 0
+#endif
+
+/* compile with -DMULTIFLOW=1 to be asked for the number of flows: each
+   flow is an A/B pair of entities with its own protocol state, and all
+   flows contend for the one emulated link.  Entity e belongs to flow
+   e/2 and is side A or B by e%2.  */
+#ifndef MULTIFLOW
+#define MULTIFLOW 0
+#endif
+
+/* compile with -DTRAFFIC=1 (and link with -lm) to be asked for the
+   arrival process of the messages from layer 5: the default uniform gaps,
+   Poisson arrivals, Pareto on/off bursts, batches, or the timestamps of
+   a trace file, which is read a line at a time.  */
+#ifndef TRAFFIC
+#define TRAFFIC 0
+#endif
+
+/* compile with -DSTEADY=1 (and link with -lm) to measure goodput and
+   message latency in steady state: the run is cut into batches of simulated
+   time, the warm-up batches are found with the MSER rule and dropped, and
+   the run stops as soon as the batch means confidence intervals are as
+   narrow as asked for.  Latency is measured from the message numbers of
+   VERIFY, which STEADY turns on.  */
+#ifndef STEADY
+#define STEADY 0
+#endif
+
+/* compile with -DVERIFY=1 to check every delivery to layer 5: each
+   message carries its number, so tolayer5 can check in O(1) that the
+   messages of each sender arrive in order, once, and unaltered.
+   Messages failing the check are counted as errors, not as delivered.  */
+#ifndef VERIFY
+#define VERIFY STEADY
+#endif
+#if STEADY && !VERIFY
+#error "STEADY needs the message numbers of VERIFY"
+#endif
+
+/* compile with -DSAMPLER=1, with gbn.c or sr.c built the same way, to
+   record the state of the run every so many time units: packets in the
+   senders' windows, packets in the medium, packets held out of order by
+   the receivers, events in the event list and messages delivered.  The
+   samples are kept in preallocated columns and written out at the end,
+   as CSV if the file name ends in .csv, otherwise in binary.  With
+   SNAPSHOT, each branch writes its own file, numbered like its NETLOG log.
+   The SAMPLER default is in emulator.h, which declares the protocol hooks.  */
+
+/* compile with -DPROFILE=1 to time the simulator itself: each event
+   handled, each call into the protocol and each call the protocol makes
+   back into the emulator is timed with the time stamp counter (or
+   clock_gettime off x86), and a breakdown is printed at the end.  */
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+
+/* compile with -DMULTIHOP=1 to be asked for a topology: A and B are
+   attached to two nodes of it and packets are forwarded hop by hop,
+   each link with its own in-order medium, loss, corruption and queue.
+   The topology file uses the edge list format of DistanceVector.c with
+   an optional fourth column scaling the link's delay:
+   "node node cost [delayscale]".  */
+#ifndef MULTIHOP
+#define MULTIHOP 0
+#endif
+
+/* compile with -DPARALLEL=1 -pthread for the conservative parallel engine: the
+   entities of the flows are shared out between worker threads, each with
+   its own event list.  The workers advance together in windows of
+   simulated time as long as the smallest delay of the medium, so that no
+   packet sent within a window can arrive within it.  To give the same
+   results whatever the number of workers, each flow has its own medium,
+   its share of the messages and each entity its own random numbers.  */
+
+/* compile with -DSNAPSHOT=1 to add what-if branching: after a common
+   warm-up the simulation is forked into several copy-on-write children,
+   each continuing with its own loss, corruption and arrival parameters.
+   The parent collects the children's statistics through shared memory. */
+#ifndef SNAPSHOT
+#define SNAPSHOT 0
+#endif
+
+#if SNAPSHOT
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+
+#if TRAFFIC || STEADY
+#include <math.h>
+#endif
+
+#if PARALLEL
+#if MULTIHOP || SNAPSHOT || NETLOG || SAMPLER || PROFILE || STEADY || BIDIRECTIONAL
+#error "the parallel engine does not support MULTIHOP, SNAPSHOT, NETLOG, SAMPLER, PROFILE, STEADY or BIDIRECTIONAL"
+#endif
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#endif
+
+#if VERIFY
+#include <string.h>
+#endif
+
+#if SAMPLER
+#include <stdint.h>
+#include <string.h>
+#endif
+
+#if PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+/* the student-callable routines are defined under these names, and
+   wrapped in timed versions in the PROFILE section below */
+#define  tolayer3    emutolayer3
+#define  tolayer5    emutolayer5
+#define  starttimer  emustarttimer
+#define  stoptimer   emustoptimer
+#endif
+
+#if NETLOG
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 struct event {
   float evtime;           /* event time */
   int evtype;             /* event type code */
   int eventity;           /* entity where event occurs */
-  struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
-  struct event *prev;
-  struct event *next;
+  int evindex;            /* position of the event in the event list */
+  double evseq;              /* order in which events were scheduled, exact up to 2^53 */
+  struct pkt packet;      /* packet (if any) assoc w/ this event */
+  int evnode;             /* node a forwarded packet arrives at */
+  int evlink;             /* link a forwarded packet arrives on */
+  int evhops;             /* links a forwarded packet has crossed */
+  struct event *next;     /* next free event */
 };
 
-struct event *evlist = NULL;   /* the event list */
+/* the event list is a binary heap, so that scheduling and cancelling an */
+/* event costs O(log n) however many entities share the emulator         */
+static EMU_LOCAL struct event **evlist = NULL;   /* the event list */
+static EMU_LOCAL int nevents = 0;                /* number of events in the list */
+static EMU_LOCAL int maxevents = 0;              /* allocated size of the list */
+#if !PARALLEL
+static double nscheduled = 0;  /* events scheduled so far */
+#endif
+static EMU_LOCAL struct event *freeevents = NULL;    /* events for reuse */
 
 /* possible events: */
 #define  TIMER_INTERRUPT 0  
 #define  FROM_LAYER5     1
 #define  FROM_LAYER3     2
+#define  FROM_LINK       3    /* forwarded packet arrives at a node */
+#if MULTIHOP
+#define  NEVENTTYPES     4
+#else
+#define  NEVENTTYPES     3
+#endif
+
+/* entities: */
+#define  FLOWOF(e)       ((e) >> 1)      /* flow an entity belongs to */
+#define  SIDEOF(e)       ((e) & 1)       /* A or B */
+#define  ENTITY(f,AorB)  (2*(f) + (AorB))
+#define  PEER(e)         ((e) ^ 1)       /* entity at the other end of the link */
+#if PARALLEL
+#define  MEDIUM(e)       (e)             /* each flow has its own medium each way */
+#else
+#define  MEDIUM(e)       SIDEOF(e)       /* medium towards e, shared by all flows */
+#endif
 
 #define  OFF             0
 #define  ON              1
@@ -61,29 +234,71 @@ struct event *evlist = NULL;   /* the event list */
 int TRACE = 3;
 
 /* statistics updated by GBN */
-int window_full;   /* count of the number of messages dropped due to full window */
-int total_ACKs_received;
-int packets_resent;       /* count of the number of packets resent  */
-int new_ACKs;           /* count of the number of acks correctly received */
-int packets_received;  /* count of the packets received by receiver */
+EMU_LOCAL int window_full;   /* count of the number of messages dropped due to full window */
+EMU_LOCAL int total_ACKs_received;
+EMU_LOCAL int packets_resent;       /* count of the number of packets resent  */
+EMU_LOCAL int new_ACKs;           /* count of the number of acks correctly received */
+EMU_LOCAL int packets_received;  /* count of the packets received by receiver */
+#if SENDQUEUE
+EMU_LOCAL int messages_queued;
+EMU_LOCAL int messages_dequeued;
+EMU_LOCAL int queue_high_watermarks;
+EMU_LOCAL int queue_low_watermarks;
+EMU_LOCAL double queueing_delay;
+EMU_LOCAL float max_queueing_delay;
+#endif
+#if NAKS
+EMU_LOCAL int naks_sent;
+EMU_LOCAL int naks_received;
+EMU_LOCAL int nak_resends;
+#endif
+#if FEC
+EMU_LOCAL int parity_sent;
+EMU_LOCAL int packets_rebuilt;
+#endif
 
 /* statistics updated by emulator */
-static int packets_lost;  
-static int packets_corrupt;
-static int packets_sent;
-static int packets_timeout;
-static int messages_delivered;
+static EMU_LOCAL int packets_lost;  
+static EMU_LOCAL int packets_corrupt;
+static EMU_LOCAL int packets_sent;
+static EMU_LOCAL int packets_timeout;
+static EMU_LOCAL int messages_delivered;
 
-static int nsim = 0;              /* number of messages from 5 to 4 so far */ 
+static EMU_LOCAL int nsim = 0;    /* number of messages from 5 to 4 so far */ 
 static int nsimmax = 0;           /* number of msgs to generate, then stop */
-static float time = 0.000;
+static EMU_LOCAL float simtime = 0.000;
 static float lossprob;            /* probability that a packet is dropped  */
 static float corruptprob;   /* probability that one bit is packet is flipped */
 static int corruptdirection; /* A->B A<-B or bidirectional corruption/loss */
 static float lambda;        /* arrival rate of messages from layer 5 */   
-static int   ntolayer3;           /* number sent into layer 3 */
-static int   nlost;               /* number lost in media */
-static int ncorrupt;              /* number corrupted by media*/
+static EMU_LOCAL int ntolayer3;   /* number sent into layer 3 */
+static EMU_LOCAL int nlost;       /* number lost in media */
+static EMU_LOCAL int ncorrupt;    /* number corrupted by media*/
+
+static int nflows = 1;            /* number of A/B pairs sharing the link */
+static EMU_LOCAL int curflow;     /* flow of the event being handled */
+static EMU_LOCAL int curentity;   /* entity of the event being handled */
+static struct event **timers;     /* running timer of each entity, or NULL */
+static float *lastarrival;        /* latest arrival in each medium, see MEDIUM() */
+static int *inmedium;             /* packets in each medium */
+static int linkqueue = 0;         /* max packets in the medium each way, 0 = no limit */
+static EMU_LOCAL int nqueuedrops; /* number dropped because the medium was full */
+static int *flowdelivered;        /* messages delivered to layer 5, per flow */
+
+#if PARALLEL
+static unsigned long long *entityrng;   /* random number generator of each entity */
+
+/* splitmix64 generator of the entity being handled, uniform in [0,1) */
+static double entityrand(void)
+{
+  unsigned long long z = (entityrng[curentity] += 0x9E3779B97F4A7C15ULL);
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+#endif
 
 /****************************************************************************/
 /* jimsrand(): return a double in range [0,1].  The routine below is used to */
@@ -94,87 +309,1470 @@ double jimsrand(void)
 {
   double mmm = RAND_MAX;     /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
   double x;                   
+#if PARALLEL
+  if (entityrng != NULL)
+    x = entityrand();
+  else
+#endif
   x = rand()/mmm;            /* x should be uniform in [0,1] */
   if (TRACE > 3)
     printf("RANDOM NUMBER GENERAION CALLED: %f\n", x);
   return(x);
 }  
 
-/********************* EVENT HANDLINE ROUTINES *******/
-/*  The next set of routines handle the event list   */
-/*****************************************************/
+/****************************************************************************/
+/* NETWORK DECISIONS: every random choice made by the network is taken by   */
+/* the routines below, so that a run can be recorded to a network event log */
+/* and replayed later without calling the random number generator.         */
+/****************************************************************************/
+
+/* possible corruptions of a packet by the medium: */
+#define  CORRUPT_NONE    0
+#define  CORRUPT_PAYLOAD 1
+#define  CORRUPT_SEQNUM  2
+#define  CORRUPT_ACKNUM  3
+
+struct arrival {            /* decision taken for each message from layer 5 */
+  double gap;               /* time from now until the message arrives */
+  int entity;               /* entity the message arrives at */
+  int pad;
+};
+
+struct netdecision {        /* decision taken for each packet sent into layer 3 */
+  double jitter;            /* delay beyond 1 time unit after the last packet in the medium */
+  unsigned char lost;       /* packet is lost in the medium */
+  unsigned char corrupt;    /* one of the CORRUPT_ values above */
+  unsigned char pad[6];
+};
+
+/********************** ARRIVAL PROCESSES ***********************/
+#if TRAFFIC
+
+#define  ARRIVE_UNIFORM  0   /* gaps uniform on [0,2*lambda] */
+#define  ARRIVE_POISSON  1   /* exponential gaps with mean lambda */
+#define  ARRIVE_PARETO   2   /* Pareto on/off bursts */
+#define  ARRIVE_BATCH    3   /* batches of messages at exponential gaps */
+#define  ARRIVE_TRACE    4   /* timestamps read from a trace file */
+
+static int arrivalprocess = ARRIVE_UNIFORM;
+static float paretoshape;         /* shape of the Pareto distributions, > 1 */
+static float burstsize;           /* mean messages per burst, or per batch */
+static int *burstleft;            /* messages left in the burst of each flow */
+static FILE *tracefile;           /* arrival trace being replayed */
+static int tracelines;            /* lines of the trace read so far */
+static EMU_LOCAL unsigned long narrivals;   /* arrivals generated so far */
+static EMU_LOCAL double sumgaps, sumgaps2;  /* sum of their gaps and squared gaps */
+
+/* random number in (0,1], for the inverse distributions below */
+static double openuniform(void)
+{
+  return 1.0 - 0.999999*jimsrand();
+}
+
+static double exponential(double mean)
+{
+  return -mean * log(openuniform());
+}
+
+/* Pareto with shape paretoshape, scaled to the given mean */
+static double pareto(double mean)
+{
+  return mean * (paretoshape - 1) / paretoshape / pow(openuniform(), 1.0 / paretoshape);
+}
+
+static double uniformgap(int flow)
+{
+  (void)flow;               /* the same for every flow */
+  return lambda*jimsrand()*2;
+}
+
+static double poissongap(int flow)
+{
+  (void)flow;               /* the same for every flow */
+  return exponential(lambda);
+}
+
+/* bursts of a heavy tailed number of messages 1 time unit apart, separated
+   by heavy tailed off periods long enough to keep the mean gap at lambda */
+static double paretogap(int flow)
+{
+  double off;
+
+  if (burstleft[flow] > 0) {
+    burstleft[flow]--;
+    return 1.0;
+  }
+  burstleft[flow] = (int)(pareto(burstsize) + 0.5) - 1;
+  off = burstsize*lambda - (burstsize - 1);
+  if (off < lambda)
+    off = lambda;
+  return pareto(off);
+}
+
+/* batches of burstsize messages arriving together, at exponential gaps */
+static double batchgap(int flow)
+{
+  if (burstleft[flow] > 0) {
+    burstleft[flow]--;
+    return 0.0;
+  }
+  burstleft[flow] = (int)burstsize - 1;
+  return exponential(burstsize*lambda);
+}
+
+static double (*const arrivalgaps[ARRIVE_TRACE])(int) = {
+  uniformgap,          /* ARRIVE_UNIFORM */
+  poissongap,          /* ARRIVE_POISSON */
+  paretogap,           /* ARRIVE_PARETO */
+  batchgap             /* ARRIVE_BATCH */
+};
+
+/* next line of the trace, "time [flow]" with times in order; returns 0
+   once the trace is over */
+static int nexttrace(struct arrival *a, int *flow)
+{
+  char line[128];
+  double t;
+  int f;
+
+  while (fgets(line, sizeof(line), tracefile) != NULL) {
+    tracelines++;
+    f = 0;
+    if (sscanf(line, "%lf %d", &t, &f) < 1)
+      continue;                  /* blank or comment line */
+    a->gap = (t > simtime) ? t - simtime : 0.0;
+    a->entity = A;
+    a->pad = 0;
+    *flow = (f > 0) ? f % nflows : 0;
+    return 1;
+  }
+  return 0;
+}
+
+static void inittraffic(void)
+{
+  printf("Enter arrival process: 0 uniform, 1 Poisson, 2 Pareto on/off, 3 batch, 4 trace file:");
+  scanf("%d",&arrivalprocess);
+  if (arrivalprocess == ARRIVE_PARETO) {
+    printf("Enter Pareto shape [> 1] and mean number of messages per burst:");
+    scanf("%f %f",&paretoshape,&burstsize);
+    if (paretoshape <= 1.0)
+      paretoshape = 1.5;
+  }
+  else if (arrivalprocess == ARRIVE_BATCH) {
+    printf("Enter number of messages per batch:");
+    scanf("%f",&burstsize);
+  }
+  else if (arrivalprocess == ARRIVE_TRACE) {
+    char name[256];
+
+    if (PARALLEL) {
+      printf("trace replay is not available in the parallel engine.\n");
+      exit(EXIT_FAILURE);
+    }
+    printf("Enter arrival trace file [lines of time and optional flow]:");
+    scanf("%255s",name);
+    tracefile = fopen(name, "r");
+    if (tracefile == NULL) {
+      printf("could not open arrival trace %s.\n", name);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (arrivalprocess != ARRIVE_POISSON)
+    arrivalprocess = ARRIVE_UNIFORM;
+  if (burstsize < 1.0)
+    burstsize = 1.0;
+  burstleft = calloc(nflows, sizeof(int));
+  if (burstleft == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* number of arrivals, and the mean and coefficient of variation of their
+   gaps: 1 for Poisson arrivals, more for burstier traffic */
+static void reporttraffic(void)
+{
+  double mean, var;
+
+  if (narrivals == 0)
+    return;
+  mean = sumgaps / narrivals;
+  var = sumgaps2 / narrivals - mean*mean;
+  printf("arrivals generated: %lu, mean gap %g, coefficient of variation %g \n", narrivals, mean,
+         (mean > 0.0 && var > 0.0) ? sqrt(var) / mean : 0.0);
+  if (tracefile != NULL) {
+    printf("arrival trace lines read: %d \n", tracelines);
+    fclose(tracefile);
+  }
+}
+
+#endif
+
+static void drawarrival(struct arrival *a, int flow)
+{
+#if TRAFFIC
+  a->gap = arrivalgaps[arrivalprocess](flow);
+#else
+  (void)flow;
+  a->gap = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
+                                 /* having mean of lambda        */
+#endif
+  if (BIDIRECTIONAL && (jimsrand()>0.5) )
+    a->entity = B;
+  else
+    a->entity = A;
+  a->pad = 0;
+}
+
+static void drawdecision(int AorB, struct netdecision *d)
+{
+  int affected, i;
+  double x;
+
+  /* loss and corruption can be restricted to one direction */
+  affected = !(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B);
+
+  d->jitter = 0.0;
+  d->corrupt = CORRUPT_NONE;
+  for (i = 0; i < 6; i++)
+    d->pad[i] = 0;
+  d->lost = (jimsrand() < lossprob && affected);
+  if (d->lost)
+    return;
+
+  d->jitter = 9*jimsrand();
+  if ((jimsrand() < corruptprob) && affected) {
+    if ( (x = jimsrand()) < .75)
+      d->corrupt = CORRUPT_PAYLOAD;
+    else if (x < .875)
+      d->corrupt = CORRUPT_SEQNUM;
+    else
+      d->corrupt = CORRUPT_ACKNUM;
+  }
+}
+
+#if NETLOG
+
+#define  NETLOG_OFF      0
+#define  NETLOG_RECORD   1
+#define  NETLOG_REPLAY   2
+
+/* a network event log is this header, followed by narrivals struct arrival */
+/* records and then ndecisions struct netdecision records.  The file is     */
+/* mapped directly into memory when it is replayed.                         */
+struct netlogheader {
+  char magic[8];
+  uint64_t narrivals;
+  uint64_t ndecisions;
+};
+
+static const char netlogmagic[8] = "NETLOG1";
+
+static int netlogmode = NETLOG_OFF;
+static char netlogfile[256];
+static struct arrival *logarrivals;       /* recorded or mapped arrivals */
+static struct netdecision *logdecisions;  /* recorded or mapped decisions */
+static uint64_t nlogarrivals, nlogdecisions;
+static uint64_t maxlogarrivals, maxlogdecisions;  /* record buffer sizes */
+static uint64_t arrivalnext, decisionnext;        /* replay positions */
+static void *logmap;
+static size_t logmapsize;
+
+static void *growlog(void *log, uint64_t *max, size_t size)
+{
+  *max = (*max == 0) ? 4096 : 2 * *max;
+  log = realloc(log, *max * size);
+  if (log == 0) {
+    printf("memory allocation for network event log failed.");
+    exit(EXIT_FAILURE);
+  }
+  return log;
+}
+
+static void opennetlog(void)
+{
+  struct netlogheader *hdr;
+  struct stat st;
+  int fd;
+
+  if (netlogmode != NETLOG_REPLAY)
+    return;
+
+  fd = open(netlogfile, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    printf("unable to open network event log %s\n", netlogfile);
+    exit(EXIT_FAILURE);
+  }
+  logmapsize = st.st_size;
+  if (logmapsize < sizeof(struct netlogheader)) {
+    printf("%s is not a network event log\n", netlogfile);
+    exit(EXIT_FAILURE);
+  }
+  logmap = mmap(NULL, logmapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (logmap == MAP_FAILED) {
+    printf("unable to map network event log %s\n", netlogfile);
+    exit(EXIT_FAILURE);
+  }
+
+  hdr = logmap;
+  if (memcmp(hdr->magic, netlogmagic, sizeof(netlogmagic)) != 0 ||
+      logmapsize != sizeof(struct netlogheader) + hdr->narrivals*sizeof(struct arrival)
+                    + hdr->ndecisions*sizeof(struct netdecision) ||
+      hdr->narrivals == 0 || hdr->ndecisions == 0) {
+    printf("%s is not a valid network event log\n", netlogfile);
+    exit(EXIT_FAILURE);
+  }
+  nlogarrivals = hdr->narrivals;
+  nlogdecisions = hdr->ndecisions;
+  logarrivals = (struct arrival *)(hdr + 1);
+  logdecisions = (struct netdecision *)(logarrivals + nlogarrivals);
+  madvise(logmap, logmapsize, MADV_SEQUENTIAL);
+  printf("replaying %llu arrivals and %llu network decisions from %s\n",
+         (unsigned long long)nlogarrivals, (unsigned long long)nlogdecisions, netlogfile);
+}
+
+static void closenetlog(void)
+{
+  struct netlogheader hdr;
+  FILE *fp;
+
+  if (netlogmode == NETLOG_RECORD) {
+    fp = fopen(netlogfile, "wb");
+    if (fp == NULL) {
+      printf("unable to create network event log %s\n", netlogfile);
+      return;
+    }
+    memcpy(hdr.magic, netlogmagic, sizeof(netlogmagic));
+    hdr.narrivals = nlogarrivals;
+    hdr.ndecisions = nlogdecisions;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(logarrivals, sizeof(struct arrival), nlogarrivals, fp) != nlogarrivals ||
+        fwrite(logdecisions, sizeof(struct netdecision), nlogdecisions, fp) != nlogdecisions)
+      printf("error writing network event log %s\n", netlogfile);
+    fclose(fp);
+    printf("recorded %llu arrivals and %llu network decisions to %s\n",
+           (unsigned long long)nlogarrivals, (unsigned long long)nlogdecisions, netlogfile);
+    free(logarrivals);
+    free(logdecisions);
+  }
+  else if (netlogmode == NETLOG_REPLAY)
+    munmap(logmap, logmapsize);
+}
+
+#endif
+
+/* next message arrival of a flow, drawn at random, from the log being replayed */
+static void nextarrival(struct arrival *a, int flow)
+{
+#if NETLOG
+  if (netlogmode == NETLOG_REPLAY) {
+    if (arrivalnext == nlogarrivals) {
+      printf("network event log %s ran out of arrivals at time %f: the run goes past the recording\n",
+             netlogfile, simtime);
+      exit(EXIT_FAILURE);
+    }
+    *a = logarrivals[arrivalnext++];
+    return;
+  }
+#endif
+  drawarrival(a, flow);
+#if NETLOG
+  if (netlogmode == NETLOG_RECORD) {
+    if (nlogarrivals == maxlogarrivals)
+      logarrivals = growlog(logarrivals, &maxlogarrivals, sizeof(struct arrival));
+    logarrivals[nlogarrivals++] = *a;
+  }
+#endif
+}
+
+/* next network decision, drawn at random, from the log being replayed */
+static void nextdecision(int AorB, struct netdecision *d)
+{
+#if NETLOG
+  if (netlogmode == NETLOG_REPLAY) {
+    if (decisionnext == nlogdecisions) {
+      printf("network event log %s ran out of network decisions at time %f: the run goes past the recording\n",
+             netlogfile, simtime);
+      exit(EXIT_FAILURE);
+    }
+    *d = logdecisions[decisionnext++];
+    return;
+  }
+#endif
+  drawdecision(AorB, d);
+#if NETLOG
+  if (netlogmode == NETLOG_RECORD) {
+    if (nlogdecisions == maxlogdecisions)
+      logdecisions = growlog(logdecisions, &maxlogdecisions, sizeof(struct netdecision));
+    logdecisions[nlogdecisions++] = *d;
+  }
+#endif
+}
+
+/********************* EVENT HANDLINE ROUTINES *******/
+/*  The next set of routines handle the event list   */
+/*****************************************************/
+
+/* p is taken before q.  Events at the same time are taken newest first, */
+/* which is the order in which the original sorted event list took them */
+static int evbefore(struct event *p, struct event *q)
+{
+  if (p->evtime != q->evtime)
+    return p->evtime < q->evtime;
+  return p->evseq > q->evseq;
+}
+
+static void evplace(struct event *p, int i)
+{
+  evlist[i] = p;
+  p->evindex = i;
+}
+
+static void siftup(struct event *p, int i)
+{
+  int parent;
+
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (!evbefore(p, evlist[parent]))
+      break;
+    evplace(evlist[parent], i);
+    i = parent;
+  }
+  evplace(p, i);
+}
+
+static void siftdown(struct event *p, int i)
+{
+  int child;
+
+  while ((child = 2*i + 1) < nevents) {
+    if (child + 1 < nevents && evbefore(evlist[child + 1], evlist[child]))
+      child++;
+    if (!evbefore(evlist[child], p))
+      break;
+    evplace(evlist[child], i);
+    i = child;
+  }
+  evplace(p, i);
+}
+
+struct event *allocevent(void)
+{
+  struct event *p;
+
+  if (freeevents != NULL) {
+    p = freeevents;
+    freeevents = p->next;
+    return p;
+  }
+  p = malloc(sizeof(struct event));
+  if (p == 0) {
+    printf("memory allocation for event failed.");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+void freeevent(struct event *p)
+{
+  p->next = freeevents;
+  freeevents = p;
+}
+
+#if PARALLEL
+static int nworkers;                    /* worker threads of the parallel engine */
+static int maxworkers;                  /* the sweep runs 1, 2, 4 ... up to this many */
+static EMU_LOCAL int self;              /* worker running this thread */
+static unsigned long long *entityseq;   /* events scheduled by each entity */
+static struct event **outbox;           /* outbox[from*nworkers + to]: events for other workers */
+#define  OWNER(e)        ((e) % nworkers)    /* worker an entity is simulated by */
+#endif
+
+/* put p in the event list, which is already in order */
+static void heapinsert(struct event *p)
+{
+  if (nevents == maxevents) {
+    maxevents = (maxevents == 0) ? 64 : 2*maxevents;
+    evlist = realloc(evlist, maxevents * sizeof(struct event *));
+    if (evlist == 0) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  siftup(p, nevents++);
+}
+
+void insertevent(struct event *p)
+{
+  if (TRACE>2) {
+    printf("            INSERTEVENT: time is %f\n",simtime);
+    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
+  }
+#if PARALLEL
+  /* events at the same time are ordered by the entity that scheduled them, */
+  /* so that the order does not depend on how entities are shared out      */
+  p->evseq = curentity * 1099511627776.0 + entityseq[curentity]++;   /* entity * 2^40 + n */
+  if (OWNER(p->eventity) != self) {
+    p->next = outbox[self*nworkers + OWNER(p->eventity)];
+    outbox[self*nworkers + OWNER(p->eventity)] = p;
+    return;
+  }
+#else
+  p->evseq = nscheduled++;
+#endif
+  heapinsert(p);
+}
+
+/* take event p out of the event list */
+void removeevent(struct event *p)
+{
+  struct event *last;
+
+  last = evlist[--nevents];
+  if (last == p)
+    return;
+  if (p->evindex > 0 && evbefore(last, evlist[(p->evindex - 1) / 2]))
+    siftup(last, p->evindex);
+  else
+    siftdown(last, p->evindex);
+}
+
+/* next event to simulate, or NULL when there are none left */
+struct event *nextevent(void)
+{
+  return (nevents > 0) ? evlist[0] : NULL;
+}
+
+void generate_next_arrival(int flow)
+{
+  struct arrival a;
+  struct event *evptr;
+
+  if (TRACE>2)
+    printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
+ 
+#if TRAFFIC
+  if (arrivalprocess == ARRIVE_TRACE) {
+    if (!nexttrace(&a, &flow))
+      return;                  /* the trace is over */
+  }
+  else
+#endif
+  nextarrival(&a, flow);
+#if TRAFFIC
+  narrivals++;
+  sumgaps += a.gap;
+  sumgaps2 += a.gap*a.gap;
+#endif
+  evptr = allocevent();
+  evptr->evtime =  simtime + a.gap;
+  evptr->evtype =  FROM_LAYER5;
+  evptr->eventity = ENTITY(flow, a.entity);
+  insertevent(evptr);
+} 
+
+void printevlist(void)
+{
+  int i;
+  printf("--------------\nEvent List Follows:\n");
+  for (i = 0; i < nevents; i++) {
+    printf("Event time: %f, type: %d entity: %d\n",evlist[i]->evtime,evlist[i]->evtype,evlist[i]->eventity);
+  }
+  printf("--------------\n");
+}
+
+/********************** SIMULATION SNAPSHOTS ***********************/
+#if SNAPSHOT
+
+#define MAXBRANCHES 64
+
+struct branch {            /* parameters and results of one what-if branch */
+  float lossprob;
+  float corruptprob;
+  float lambda;
+  int done;                /* set by the child once its results are in */
+  float time;
+  int nsim;
+  int window_full;
+  int new_ACKs;
+  int packets_resent;
+  int packets_received;
+  int messages_delivered;
+};
+
+static int nbranches;            /* number of branches, 0 = no branching */
+static int branchmsgs;           /* branch once this many msgs have been generated */
+static float branchtime;         /* or else branch at this simulated time */
+static int branched;             /* the simulation has been branched */
+static int branchid;             /* branch simulated by this process */
+static struct branch branchparam[MAXBRANCHES];
+static struct branch *branches;  /* results, shared with the children */
+
+void initbranches(void)
+{
+  int i;
+
+  printf("Enter number of what-if branches [0 for none]:");
+  scanf("%d",&nbranches);
+  if (nbranches <= 0) {
+    nbranches = 0;
+    return;
+  }
+  if (nbranches > MAXBRANCHES)
+    nbranches = MAXBRANCHES;
+  printf("Enter number of messages to simulate before branching [0 to branch at a time]:");
+  scanf("%d",&branchmsgs);
+  if (branchmsgs <= 0) {
+    printf("Enter simulated time to branch at:");
+    scanf("%f",&branchtime);
+  }
+  for (i=0; i<nbranches; i++) {
+    printf("Enter loss probability, corruption probability and average time between messages for branch %d:",i);
+    scanf("%f %f %f",&branchparam[i].lossprob,&branchparam[i].corruptprob,&branchparam[i].lambda);
+  }
+}
+
+/* is it time to fork the simulation into its branches? */
+int branchdue(void)
+{
+  if (nbranches == 0 || branched)
+    return 0;
+  if (branchmsgs > 0)
+    return nsim >= branchmsgs;
+  return nextevent() != NULL && nextevent()->evtime >= branchtime;
+}
+
+void reportbranches(void);
+
+/* the pending message of each flow was drawn with the parent's lambda;
+   draw it again, from now, with the branch's */
+static void redrawarrivals(void)
+{
+  struct event **pending;
+  int i, n;
+
+#if TRAFFIC
+  if (arrivalprocess == ARRIVE_TRACE)
+    return;                      /* trace times do not depend on lambda */
+#endif
+  pending = malloc((nevents + 1) * sizeof(struct event *));
+  if (pending == 0) {
+    printf("memory allocation for branch arrivals failed.");
+    exit(EXIT_FAILURE);
+  }
+  n = 0;
+  for (i=0; i<nevents; i++)
+    if (evlist[i]->evtype == FROM_LAYER5)
+      pending[n++] = evlist[i];
+  for (i=0; i<n; i++) {
+    removeevent(pending[i]);
+    generate_next_arrival(FLOWOF(pending[i]->eventity));
+    freeevent(pending[i]);
+  }
+  free(pending);
+}
+
+/* fork one child per branch.  Returns in each child with that branch's
+   parameters in place; the parent waits for all children, reports their
+   results and exits. */
+void branch(void)
+{
+  int i;
+  pid_t pid;
+
+  branched = 1;
+  branches = mmap(NULL, nbranches * sizeof(struct branch), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (branches == MAP_FAILED) {
+    printf("memory allocation for branch results failed.");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(branches, branchparam, nbranches * sizeof(struct branch));
+
+  printf("          BRANCH: forking %d branches at time %f after %d msgs\n",nbranches,simtime,nsim);
+  fflush(stdout);                /* so children do not repeat buffered output */
+  for (i=0; i<nbranches; i++) {
+    pid = fork();
+    if (pid < 0) {
+      printf("unable to fork branch %d\n",i);
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {              /* child: continue with this branch's parameters */
+      branchid = i;
+      lossprob = branches[i].lossprob;
+      corruptprob = branches[i].corruptprob;
+      if (branches[i].lambda != lambda) {
+        lambda = branches[i].lambda;
+        redrawarrivals();
+      }
+#if NETLOG
+      if (netlogmode == NETLOG_RECORD)   /* each branch records its own log */
+        snprintf(netlogfile + strlen(netlogfile), sizeof(netlogfile) - strlen(netlogfile), ".%d", i);
+#endif
+      return;
+    }
+  }
+
+  while (wait(NULL) > 0)
+    ;
+  reportbranches();
+  exit(EXIT_SUCCESS);
+}
+
+/* called by each child at termination, to pass its results to the parent */
+void finishbranch(void)
+{
+  struct branch *b = &branches[branchid];
+
+  b->time = simtime;
+  b->nsim = nsim;
+  b->window_full = window_full;
+  b->new_ACKs = new_ACKs;
+  b->packets_resent = packets_resent;
+  b->packets_received = packets_received;
+  b->messages_delivered = messages_delivered;
+  b->done = 1;
+}
+
+void reportbranches(void)
+{
+  struct branch *b;
+  int i;
+
+  printf(" Simulator branched at time %f after %d msgs from layer5\n",simtime,nsim);
+  printf("branch    loss corrupt  lambda        time  msgs  full  acks resent recvd delivered\n");
+  for (i=0; i<nbranches; i++) {
+    b = &branches[i];
+    if (!b->done) {
+      printf("%6d %7.3f %7.3f %7.2f  did not complete\n",i,b->lossprob,b->corruptprob,b->lambda);
+      continue;
+    }
+    printf("%6d %7.3f %7.3f %7.2f %11.2f %5d %5d %5d %6d %5d %9d\n",i,b->lossprob,b->corruptprob,
+           b->lambda,b->time,b->nsim,b->window_full,b->new_ACKs,b->packets_resent,
+           b->packets_received,b->messages_delivered);
+  }
+  munmap(branches, nbranches * sizeof(struct branch));
+}
+
+#endif
+
+/********************** MULTI-HOP FORWARDING ***********************/
+#if MULTIHOP
+
+struct hoplink {          /* one direction of a link between two nodes */
+  int from, to;
+  int cost;               /* routing cost */
+  float scale;            /* delay multiplier, > 1 for a slow link */
+  float lastarrival;      /* latest arrival at the far end, for in order delivery */
+  int queued;             /* packets on the link */
+  int carried;            /* statistics for the link */
+  int lost;
+  int drops;
+  int corrupt;
+  double queueing;        /* total time packets waited behind earlier packets */
+  float maxqueueing;
+};
+
+static int nnodes = 0;            /* nodes in the topology, 0 = single hop */
+static int nhoplinks;
+static struct hoplink *links;     /* links sorted by the node they leave */
+static int *linkstart;            /* first link leaving each node */
+static int endpoint[2];           /* nodes A and B are attached to */
+static int *route[2];             /* link from each node towards A and B, or -1 */
+static int hopqueue;              /* max packets queued on a link, 0 = no limit */
+static int nunroutable;           /* number dropped for want of a route */
+
+static int cmphoplink(const void *p, const void *q)
+{
+  const struct hoplink *a = p, *b = q;
+
+  if (a->from != b->from)
+    return a->from - b->from;
+  return a->to - b->to;
+}
+
+/* link from node u to node v, or -1 */
+static int findlink(int u, int v)
+{
+  int l;
+
+  for (l = linkstart[u]; l < linkstart[u+1]; l++)
+    if (links[l].to == v)
+      return l;
+  return -1;
+}
+
+void readhoptopology(const char *file)
+{
+  FILE *fp;
+  char line[256];
+  int u, v, c, n, max = 0;
+  float scale;
+
+  fp = fopen(file, "r");
+  if (fp == NULL) {
+    printf("unable to open topology file %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+  nhoplinks = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || (n = sscanf(line, "%d %d %d %f", &u, &v, &c, &scale)) < 3)
+      continue;
+    if (n == 3)
+      scale = 1.0;
+    if (u < 0 || v < 0 || u == v || c <= 0 || scale <= 0.0) {
+      printf("ignoring bad link: %s", line);
+      continue;
+    }
+    if (nhoplinks + 2 > max) {
+      max = (max == 0) ? 64 : 2*max;
+      links = realloc(links, max * sizeof(struct hoplink));
+      if (links == 0) {
+        printf("memory allocation for topology failed.");
+        exit(EXIT_FAILURE);
+      }
+    }
+    links[nhoplinks].from = u;  links[nhoplinks].to = v;
+    links[nhoplinks].cost = c;  links[nhoplinks++].scale = scale;
+    links[nhoplinks].from = v;  links[nhoplinks].to = u;
+    links[nhoplinks].cost = c;  links[nhoplinks++].scale = scale;
+    if (u >= nnodes) nnodes = u + 1;
+    if (v >= nnodes) nnodes = v + 1;
+  }
+  fclose(fp);
+  if (nnodes == 0) {
+    printf("no links in topology file %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+
+  qsort(links, nhoplinks, sizeof(struct hoplink), cmphoplink);
+  linkstart = calloc(nnodes + 1, sizeof(int));
+  if (linkstart == 0) {
+    printf("memory allocation for topology failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (n = 0; n < nhoplinks; n++) {
+    links[n].lastarrival = 0.0;
+    links[n].queued = links[n].carried = links[n].lost = 0;
+    links[n].drops = links[n].corrupt = 0;
+    links[n].queueing = links[n].maxqueueing = 0.0;
+    linkstart[links[n].from + 1]++;
+  }
+  for (u = 0; u < nnodes; u++)
+    linkstart[u+1] += linkstart[u];
+}
+
+/* forwarding tables towards node dest along least cost paths */
+void shortestroutes(int dest, int *next)
+{
+  int *d = malloc(nnodes * sizeof(int));
+  char *done = calloc(nnodes, 1);
+  int u, v, l, i;
+
+  if (d == 0 || done == 0) {
+    printf("memory allocation for routing failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (u = 0; u < nnodes; u++) {
+    d[u] = -1;
+    next[u] = -1;
+  }
+  d[dest] = 0;
+  /* Dijkstra, simple O(n^2) form: topologies here are small */
+  for (i = 0; i < nnodes; i++) {
+    for (u = -1, v = 0; v < nnodes; v++)
+      if (!done[v] && d[v] >= 0 && (u < 0 || d[v] < d[u]))
+        u = v;
+    if (u < 0)
+      break;
+    done[u] = 1;
+    for (l = linkstart[u]; l < linkstart[u+1]; l++) {
+      v = links[l].to;
+      if (!done[v] && (d[v] < 0 || d[u] + links[l].cost < d[v])) {
+        d[v] = d[u] + links[l].cost;
+        next[v] = findlink(v, u);     /* links are symmetric */
+      }
+    }
+  }
+  free(d);
+  free(done);
+}
+
+/* forwarding table file: "node destination nexthop" per line */
+void readroutes(const char *file)
+{
+  FILE *fp;
+  char line[256];
+  int u, dest, v, side;
+
+  fp = fopen(file, "r");
+  if (fp == NULL) {
+    printf("unable to open forwarding table file %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%d %d %d", &u, &dest, &v) != 3)
+      continue;
+    for (side = A; side <= B; side++)
+      if (dest == endpoint[side] && u >= 0 && u < nnodes && v >= 0 && v < nnodes) {
+        route[side][u] = findlink(u, v);
+        if (route[side][u] < 0)
+          printf("ignoring route over missing link: %s", line);
+      }
+  }
+  fclose(fp);
+}
+
+void inithops(void)
+{
+  char file[256];
+  int side, n, hops;
+
+  printf("Enter topology edge list file:");
+  scanf("%255s",file);
+  readhoptopology(file);
+  printf("Enter nodes A and B are attached to:");
+  scanf("%d %d",&endpoint[A],&endpoint[B]);
+  if (endpoint[A] < 0 || endpoint[A] >= nnodes || endpoint[B] < 0 || endpoint[B] >= nnodes
+      || endpoint[A] == endpoint[B]) {
+    printf("A and B must be attached to two different nodes of the topology\n");
+    exit(EXIT_FAILURE);
+  }
+  for (side = A; side <= B; side++) {
+    route[side] = malloc(nnodes * sizeof(int));
+    if (route[side] == 0) {
+      printf("memory allocation for routing failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  printf("Enter forwarding table file [- for least cost paths]:");
+  scanf("%255s",file);
+  for (side = A; side <= B; side++)
+    shortestroutes(endpoint[side], route[side]);
+  if (file[0] != '-' || file[1] != '\0')
+    readroutes(file);
+  printf("Enter maximum number of packets queued on each link [0 for no limit]:");
+  scanf("%d",&hopqueue);
+
+  for (hops = 0, n = endpoint[A]; n != endpoint[B] && route[B][n] >= 0 && hops <= nnodes; hops++)
+    n = links[route[B][n]].to;
+  if (n != endpoint[B])
+    printf("Warning: no route from A's node %d to B's node %d\n", endpoint[A], endpoint[B]);
+  else
+    printf("%d nodes, path from A to B is %d hops\n", nnodes, hops);
+  nunroutable = 0;
+}
+
+/* send the packet in evptr from node over the next link towards its */
+/* destination.  Each link has its own medium, like the single hop one. */
+void forward(struct event *evptr, int node)
+{
+  struct hoplink *k;
+  struct netdecision d;
+  float lastime;
+  int l;
+
+  l = route[SIDEOF(evptr->eventity)][node];
+  if (l < 0 || ++evptr->evhops > nnodes) {
+    nunroutable++;
+    if (TRACE>0)
+      printf("          FORWARD: no route at node %d, packet being dropped\n", node);
+    freeevent(evptr);
+    return;
+  }
+  k = &links[l];
+  k->carried++;
+
+  nextdecision(!SIDEOF(evptr->eventity), &d);
+  if (d.lost) {
+    k->lost++;
+    nlost++;
+    if (TRACE>0)
+      printf("          FORWARD: packet being lost on link %d->%d\n", k->from, k->to);
+    freeevent(evptr);
+    return;
+  }
+  if (hopqueue > 0 && k->queued >= hopqueue) {
+    k->drops++;
+    nqueuedrops++;
+    if (TRACE>0)
+      printf("          FORWARD: link %d->%d queue full, packet being dropped\n", k->from, k->to);
+    freeevent(evptr);
+    return;
+  }
+  k->queued++;
+
+  lastime = simtime;
+  if (k->lastarrival > lastime)
+    lastime = k->lastarrival;
+  k->queueing += lastime - simtime;
+  if (lastime - simtime > k->maxqueueing)
+    k->maxqueueing = lastime - simtime;
+  evptr->evtime = lastime + k->scale * (1 + d.jitter);
+  k->lastarrival = evptr->evtime;
+
+  if (d.corrupt != CORRUPT_NONE) {
+    k->corrupt++;
+    ncorrupt++;
+    if (d.corrupt == CORRUPT_PAYLOAD)
+      evptr->packet.payload[0]='Z';
+    else if (d.corrupt == CORRUPT_SEQNUM)
+      evptr->packet.seqnum = 999999;
+    else
+      evptr->packet.acknum = 999999;
+    if (TRACE>0)
+      printf("          FORWARD: packet being corrupted on link %d->%d\n", k->from, k->to);
+  }
+
+  evptr->evtype = FROM_LINK;
+  evptr->evnode = k->to;
+  evptr->evlink = l;
+  insertevent(evptr);
+}
+
+void reporthops(void)
+{
+  struct hoplink *k;
+  int l;
+
+  printf("number of packets dropped for want of a route:  %d \n", nunroutable);
+  printf("link      carried   lost  drops corrupt  avg queueing  max queueing\n");
+  for (l = 0; l < nhoplinks; l++) {
+    k = &links[l];
+    if (k->carried == 0)
+      continue;
+    printf("%4d->%-4d %7d %6d %6d %7d %13.2f %13.2f\n", k->from, k->to, k->carried, k->lost,
+           k->drops, k->corrupt, k->queueing / k->carried, k->maxqueueing);
+  }
+}
+
+#endif
+
+/********************** SAMPLER ***********************/
+#if SAMPLER
+
+#define  SAMPLECOLUMNS   5
+
+static const char *const samplenames[SAMPLECOLUMNS] = {
+  "window", "inflight", "buffered", "events", "delivered"
+};
+
+static float sampleinterval;      /* time units between samples */
+static float nextsample;          /* time of the next sample */
+static int maxsamples;            /* room in each column */
+static int nsamples;
+static float *sampletimes;
+static int *samples[SAMPLECOLUMNS];
+static int ninflight;             /* packets in the medium */
+static char samplefile[256];
+
+static void initsampler(void)
+{
+  int i;
+
+  printf("Enter time between samples [0 for no sampling]:");
+  scanf("%f",&sampleinterval);
+  if (sampleinterval <= 0.0)
+    return;
+  printf("Enter largest number of samples:");
+  scanf("%d",&maxsamples);
+  printf("Enter sample file [name.csv for CSV, otherwise binary]:");
+  scanf("%255s",samplefile);
+  if (maxsamples < 1)
+    maxsamples = 1;
+  sampletimes = malloc(maxsamples * sizeof(float));
+  for (i=0; i<SAMPLECOLUMNS; i++)
+    samples[i] = malloc(maxsamples * sizeof(int));
+  for (i=0; i<SAMPLECOLUMNS; i++)
+    if (samples[i] == 0 || sampletimes == 0) {
+      printf("memory allocation for samples failed.");
+      exit(EXIT_FAILURE);
+    }
+  nextsample = 0.0;
+}
+
+/* record the state as it stands at time t */
+static void takesample(float t)
+{
+  int window, buffered, inflight, i;
+
+  window = buffered = 0;
+  for (i=0; i<nflows; i++) {
+    window += A_windowdepth(i);
+    buffered += B_bufferdepth(i);
+  }
+  inflight = ninflight;
+#if MULTIHOP
+  if (nnodes > 0)
+    for (inflight=0, i=0; i<linkstart[nnodes]; i++)
+      inflight += links[i].queued;
+#endif
+  sampletimes[nsamples] = t;
+  samples[0][nsamples] = window;
+  samples[1][nsamples] = inflight;
+  samples[2][nsamples] = buffered;
+  samples[3][nsamples] = nevents;
+  samples[4][nsamples] = messages_delivered;
+  nsamples++;
+}
+
+/* take the samples due before the event at time t */
+static void sampleto(float t)
+{
+  while (nextsample <= t && nsamples < maxsamples) {
+    takesample(nextsample);
+    nextsample += sampleinterval;
+  }
+}
+
+/* binary layout: "SAMPLES1", the number of columns and of samples as
+   uint64, then the times as floats and each column as ints */
+static void writesamples(void)
+{
+  FILE *f;
+  uint64_t n[2];
+  char name[sizeof(samplefile) + 16];
+  size_t len;
+  int csv, i, j;
+
+  if (sampleinterval <= 0.0)
+    return;
+  len = strlen(samplefile);
+  csv = (len > 4 && strcmp(samplefile + len - 4, ".csv") == 0);
+  strcpy(name, samplefile);
+#if SNAPSHOT
+  /* each branch writes its own file, name.<branch>.csv or name.<branch> */
+  if (branched) {
+    if (csv)
+      sprintf(name + len - 4, ".%d.csv", branchid);
+    else
+      sprintf(name + len, ".%d", branchid);
+  }
+#endif
+  if (csv) {
+    f = fopen(name, "w");
+    if (f == NULL) {
+      printf("could not write samples to %s.\n", name);
+      return;
+    }
+    fprintf(f, "time");
+    for (j=0; j<SAMPLECOLUMNS; j++)
+      fprintf(f, ",%s", samplenames[j]);
+    fprintf(f, "\n");
+    for (i=0; i<nsamples; i++) {
+      fprintf(f, "%g", sampletimes[i]);
+      for (j=0; j<SAMPLECOLUMNS; j++)
+        fprintf(f, ",%d", samples[j][i]);
+      fprintf(f, "\n");
+    }
+  }
+  else {
+    f = fopen(name, "wb");
+    if (f == NULL) {
+      printf("could not write samples to %s.\n", name);
+      return;
+    }
+    n[0] = SAMPLECOLUMNS;
+    n[1] = nsamples;
+    fwrite("SAMPLES1", 1, 8, f);
+    fwrite(n, sizeof(uint64_t), 2, f);
+    fwrite(sampletimes, sizeof(float), nsamples, f);
+    for (j=0; j<SAMPLECOLUMNS; j++)
+      fwrite(samples[j], sizeof(int), nsamples, f);
+  }
+  fclose(f);
+  printf("%d samples written to %s%s\n", nsamples, name,
+         (nsamples == maxsamples) ? " (sample buffer full)" : "");
+}
+
+#endif
+
+/********************** DELIVERY CHECKS ***********************/
+#if VERIFY
+
+static int verifyabort;           /* stop at the first delivery error */
+static int *msgid;                /* number of the next message from each entity */
+static int *lastdelivered;        /* number of the last message delivered to each entity */
+static EMU_LOCAL int nmisordered; /* deliveries duplicated or out of order */
+static EMU_LOCAL int nmangled;    /* deliveries not byte for byte as sent */
+static EMU_LOCAL int nskipped;    /* messages passed over by in order deliveries */
+
+/* message number id: its letter, the number in ten digits, then the letter again */
+static void stampmessage(char data[20], int id)
+{
+  int i;
+
+  for (i=0; i<20; i++)
+    data[i] = 'a' + id % 26;
+  for (i=10; i>0; i--, id /= 10)
+    data[i] = '0' + id % 10;
+}
+
+/* check a message delivered to entity e is the next one its peer sent:
+   it must be numbered after the last one delivered, and be exactly what
+   stampmessage made of that number */
+static int verifydelivery(int e, char data[20])
+{
+  char expected[20];
+  int id, i;
+
+  id = 0;
+  for (i=1; i<=10 && id >= 0; i++)
+    id = (data[i] >= '0' && data[i] <= '9') ? id*10 + data[i] - '0' : -1;
+  if (id >= 0)
+    stampmessage(expected, id);
+  if (id < 0 || memcmp(expected, data, 20) != 0)
+    nmangled++;
+  else if (id <= lastdelivered[e])
+    nmisordered++;
+  else {
+    nskipped += id - lastdelivered[e] - 1;
+    lastdelivered[e] = id;
+    return 1;
+  }
+  if (TRACE>0 || verifyabort)
+    printf("          TOLAYER5: delivery error at %s of flow %d at time %f: %.20s after message %d\n",
+           (SIDEOF(e) == A) ? "A" : "B", FLOWOF(e), simtime, data, lastdelivered[e]);
+  if (verifyabort)
+    exit(EXIT_FAILURE);
+  return 0;
+}
+
+static void initverify(void)
+{
+  int i;
+
+  printf("Enter 1 to stop at the first delivery error [0 to count them]:");
+  scanf("%d",&verifyabort);
+  msgid = calloc(2*nflows, sizeof(int));
+  lastdelivered = malloc(2*nflows * sizeof(int));
+  if (msgid == 0 || lastdelivered == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (i=0; i<2*nflows; i++)
+    lastdelivered[i] = -1;
+}
+
+#endif
+
+/********************** STEADY STATE ***********************/
+#if STEADY
+
+#define  MINBATCHES  10             /* batches needed after the warm-up for an interval */
+
+struct interval {           /* batch means confidence interval */
+  double mean;
+  double halfwidth;
+  int nbatches;             /* batches it is based on */
+};
+
+static float batchlen;            /* time units per batch */
+static float target;              /* relative half-width to stop at */
+static float confidence;          /* 0.90, 0.95 or 0.99 */
+static double zvalue;             /* normal quantile for the confidence */
+static float batchend;            /* end of the current batch */
+static int batchdeliveries;       /* in the current batch */
+static double batchlatency;       /* total latency of those deliveries */
+static double *goodputs;          /* mean of each batch */
+static double *latencies;         /* mean of each batch, -1 if nothing was delivered */
+static int nbatches, maxbatches;
+static int warmup;                /* batches dropped as the warm-up */
+static int reachedtarget;
+static struct interval goodputci, latencyci;
+struct msgtimes {           /* generation times of an entity's undelivered messages */
+  float *when;              /* when[id & (size-1)] for ids first..next-1 */
+  int size;                 /* a power of 2 */
+  int first;                /* oldest id that may still be delivered */
+  int next;                 /* id of the next message */
+};
+
+static struct msgtimes *msgtimes;
+
+static void initsteady(void)
+{
+  printf("Enter batch length in time units:");
+  scanf("%f",&batchlen);
+  printf("Enter relative half-width to stop at [e.g. 0.01] and confidence [0.90, 0.95 or 0.99]:");
+  scanf("%f %f",&target,&confidence);
+  if (batchlen <= 0.0)
+    batchlen = 100.0;
+  if (confidence > 0.985)
+    zvalue = 2.576;
+  else if (confidence < 0.925)
+    zvalue = 1.645;
+  else {
+    confidence = 0.95;
+    zvalue = 1.960;
+  }
+  batchend = batchlen;
+  msgtimes = calloc(2*nflows, sizeof(struct msgtimes));
+  if (msgtimes == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* message id from entity e is generated now.  Only the messages after the
+   last one delivered are kept, as messages are delivered in order */
+static void steadygenerated(int e, int id)
+{
+  struct msgtimes *m = &msgtimes[e];
+  float *when;
+  int i, size;
+
+  if (id - m->first >= m->size) {
+    size = m->size ? 2*m->size : 1024;
+    while (id - m->first >= size)
+      size *= 2;
+    when = malloc(size * sizeof(float));
+    if (when == 0) {
+      printf("memory allocation for message times failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i=m->first; i<m->next; i++)
+      when[i & (size - 1)] = m->when[i & (m->size - 1)];
+    free(m->when);
+    m->when = when;
+    m->size = size;
+  }
+  m->when[id & (m->size - 1)] = simtime;
+  m->next = id + 1;
+}
+
+/* message id from entity e is delivered now, after passing the checks;
+   its time and those of any messages skipped before it are dropped */
+static void steadydelivered(int e, int id)
+{
+  struct msgtimes *m = &msgtimes[e];
+
+  if (id < m->first || id >= m->next)
+    return;
+  batchdeliveries++;
+  batchlatency += simtime - m->when[id & (m->size - 1)];
+  m->first = id + 1;
+}
+
+/* Student's t quantile for df degrees of freedom, from the normal one */
+static double tquantile(int df)
+{
+  double z = zvalue;
+
+  return z + (z*z*z + z) / (4.0*df) + (5*z*z*z*z*z + 16*z*z*z + 3*z) / (96.0*df*df);
+}
+
+/* interval over batches from..nbatches-1 of x, skipping negative means */
+static struct interval batchinterval(const double *x, int from)
+{
+  struct interval ci;
+  double sum, sumsq, var;
+  int i;
 
-void insertevent(struct event *p)
+  sum = sumsq = 0.0;
+  ci.nbatches = 0;
+  for (i=from; i<nbatches; i++)
+    if (x[i] >= 0.0) {
+      sum += x[i];
+      sumsq += x[i]*x[i];
+      ci.nbatches++;
+    }
+  ci.mean = ci.halfwidth = 0.0;
+  if (ci.nbatches < 2)
+    return ci;
+  ci.mean = sum / ci.nbatches;
+  var = (sumsq - ci.nbatches*ci.mean*ci.mean) / (ci.nbatches - 1);
+  ci.halfwidth = (var > 0.0) ? tquantile(ci.nbatches - 1) * sqrt(var / ci.nbatches) : 0.0;
+  return ci;
+}
+
+/* MSER: drop the first d batches, d up to half of them, that minimise
+   the variance of the remaining goodputs divided by their number squared */
+static int mserwarmup(void)
 {
-  struct event *q,*qold;
+  double sum, sumsq, mean, score, best;
+  int d, n, bestd;
 
-  if (TRACE>2) {
-    printf("            INSERTEVENT: time is %f\n",time);
-    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
+  sum = sumsq = 0.0;
+  for (d=0; d<nbatches; d++) {
+    sum += goodputs[d];
+    sumsq += goodputs[d]*goodputs[d];
   }
-  q = evlist;     /* q points to front of list in which p struct inserted */
-  if (q==NULL) {   /* list is empty */
-    evlist=p;
-    p->next=NULL;
-    p->prev=NULL;
-  }
-  else {
-    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-      qold=q; 
-    if (q==NULL) {   /* end of list */
-      qold->next = p;
-      p->prev = qold;
-      p->next = NULL;
-    }
-    else if (q==evlist) { /* front of list */
-      p->next=evlist;
-      p->prev=NULL;
-      p->next->prev=p;
-      evlist = p;
-    }
-    else {     /* middle of list */
-      p->next=q;
-      p->prev=q->prev;
-      q->prev->next=p;
-      q->prev=p;
+  best = -1.0;
+  bestd = 0;
+  for (d=0; d<=nbatches/2; d++) {
+    n = nbatches - d;
+    mean = sum / n;
+    score = (sumsq - n*mean*mean) / ((double)n*n);
+    if (best < 0.0 || score < best) {
+      best = score;
+      bestd = d;
     }
+    sum -= goodputs[d];
+    sumsq -= goodputs[d]*goodputs[d];
   }
+  return bestd;
 }
 
-void generate_next_arrival(void)
+static int precise(struct interval *ci)
 {
-  double x;
-  struct event *evptr;
+  return ci->nbatches >= MINBATCHES && ci->halfwidth <= target * fabs(ci->mean);
+}
 
-  if (TRACE>2)
-    printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
- 
-  x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
-  /* having mean of lambda        */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
+/* close the batches that end before time t; returns 1 once both
+   intervals are narrow enough to stop */
+static int steadyto(float t)
+{
+  while (batchend <= t) {
+    if (nbatches == maxbatches) {
+      maxbatches = maxbatches ? 2*maxbatches : 256;
+      goodputs = realloc(goodputs, maxbatches * sizeof(double));
+      latencies = realloc(latencies, maxbatches * sizeof(double));
+      if (goodputs == 0 || latencies == 0) {
+        printf("memory allocation for batches failed.");
+        exit(EXIT_FAILURE);
+      }
+    }
+    goodputs[nbatches] = batchdeliveries / batchlen;
+    latencies[nbatches] = (batchdeliveries > 0) ? batchlatency / batchdeliveries : -1.0;
+    nbatches++;
+    batchdeliveries = 0;
+    batchlatency = 0.0;
+    batchend += batchlen;
+
+    warmup = mserwarmup();
+    goodputci = batchinterval(goodputs, warmup);
+    latencyci = batchinterval(latencies, warmup);
+    if (precise(&goodputci) && precise(&latencyci)) {
+      reachedtarget = 1;
+      return 1;
+    }
   }
-  evptr->evtime =  time + x;
-  evptr->evtype =  FROM_LAYER5;
-  if (BIDIRECTIONAL && (jimsrand()>0.5) )
-    evptr->eventity = B;
-  else
-    evptr->eventity = A;
-  insertevent(evptr);
-} 
+  return 0;
+}
 
-void printevlist(void)
+static void reportsteady(void)
 {
-  struct event *q;
-  printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
-    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
-  }
-  printf("--------------\n");
+  printf("steady state: %d warm-up batches (%g time units) dropped, %d batches of %g time units kept\n",
+         warmup, warmup*batchlen, nbatches - warmup, batchlen);
+  printf("goodput:  %g msgs per time unit +- %g (%.2f%%) at %g confidence, over %d batches\n",
+         goodputci.mean, goodputci.halfwidth,
+         (goodputci.mean != 0.0) ? 100.0*goodputci.halfwidth/goodputci.mean : 0.0, confidence,
+         goodputci.nbatches);
+  printf("latency:  %g time units +- %g (%.2f%%) at %g confidence, over %d batches\n",
+         latencyci.mean, latencyci.halfwidth,
+         (latencyci.mean != 0.0) ? 100.0*latencyci.halfwidth/latencyci.mean : 0.0, confidence,
+         latencyci.nbatches);
+  if (reachedtarget)
+    printf("stopped once the relative half-widths were within %g\n", target);
+  else
+    printf("relative half-width of %g not reached\n", target);
 }
 
+#endif
+
 void init(void)                         /* initialize the simulator */
 {
   float sum, avg;
@@ -195,6 +1793,49 @@ void init(void)                         /* initialize the simulator */
   scanf("%f",&lambda);
   printf("Enter TRACE:");
   scanf("%d",&TRACE);
+#if NETLOG
+  printf("Enter network event log mode: 0 off, 1 record, 2 replay:");
+  scanf("%d",&netlogmode);
+  if (netlogmode != NETLOG_OFF) {
+    printf("Enter network event log file:");
+    scanf("%255s",netlogfile);
+  }
+  opennetlog();
+#endif
+#if MULTIFLOW || PARALLEL
+  printf("Enter number of flows sharing the link [1 for a single A/B pair]:");
+  scanf("%d",&nflows);
+  if (nflows < 1)
+    nflows = 1;
+#endif
+#if MULTIFLOW && !PARALLEL
+  printf("Enter maximum number of packets queued on the link each way [0 for no limit]:");
+  scanf("%d",&linkqueue);
+#endif
+#if PARALLEL
+  printf("Enter largest number of worker threads:");
+  scanf("%d",&maxworkers);
+  if (maxworkers < 1)
+    maxworkers = 1;
+#endif
+#if TRAFFIC
+  inittraffic();
+#endif
+#if VERIFY
+  initverify();
+#endif
+#if SAMPLER
+  initsampler();
+#endif
+#if STEADY
+  initsteady();
+#endif
+#if MULTIHOP
+  inithops();
+#endif
+#if SNAPSHOT
+  initbranches();
+#endif
 
 
   srand(9999);              /* init random number generator */
@@ -211,6 +1852,18 @@ void init(void)                         /* initialize the simulator */
 
   /* initialise statistics */
   window_full = 0;
+#if SENDQUEUE
+  messages_queued = messages_dequeued = 0;
+  queue_high_watermarks = queue_low_watermarks = 0;
+  queueing_delay = 0.0;
+  max_queueing_delay = 0.0;
+#endif
+#if NAKS
+  naks_sent = naks_received = nak_resends = 0;
+#endif
+#if FEC
+  parity_sent = packets_rebuilt = 0;
+#endif
   total_ACKs_received = 0;
   packets_resent = 0;
   new_ACKs = 0;
@@ -224,40 +1877,67 @@ void init(void)                         /* initialize the simulator */
   ntolayer3 = 0;
   nlost = 0;
   ncorrupt = 0;
+  nqueuedrops = 0;
+
+  timers = calloc(2*nflows, sizeof(struct event *));
+  flowdelivered = calloc(nflows, sizeof(int));
+  lastarrival = calloc(MEDIUM(2*nflows-1)+1, sizeof(float));
+  inmedium = calloc(MEDIUM(2*nflows-1)+1, sizeof(int));
+  if (timers == 0 || flowdelivered == 0 || lastarrival == 0 || inmedium == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+#if PARALLEL
+  /* the workers generate the first arrivals */
+  return;
+#endif
 
-  time=0.0;                    /* initialize time to 0.0 */
-  generate_next_arrival();     /* initialize event list */
+  simtime=0.0;                    /* initialize time to 0.0 */
+#if TRAFFIC
+  if (arrivalprocess == ARRIVE_TRACE) {
+    generate_next_arrival(0);  /* the trace says which flow each arrival is for */
+    return;
+  }
+#endif
+  for (i=0; i<nflows; i++)
+    generate_next_arrival(i);  /* initialize event list */
 }
 
 /********************** Student-callable ROUTINES ***********************/
 
+/* flow whose event is being handled */
+int currentflow(void)
+{
+  return curflow;
+}
+
+/* number of flows sharing the link */
+int numflows(void)
+{
+  return nflows;
+}
+
+/* simulated time now */
+float currenttime(void)
+{
+  return simtime;
+}
+
 /* called by students routine to cancel a previously-started timer */
 void stoptimer(int AorB)
 /* A or B is trying to stop timer */
 {
-  struct event *q;
+  struct event **q = &timers[ENTITY(curflow, AorB)];
 
   if (TRACE>1)
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      /* remove this event */
-      if (q->next==NULL && q->prev==NULL)
-        evlist=NULL;         /* remove first and only event on list */
-      else if (q->next==NULL) /* end of list - there is one in front */
-        q->prev->next = NULL;
-      else if (q==evlist) { /* front of list - there must be event after */
-        q->next->prev=NULL;
-        evlist = q->next;
-      }
-      else {     /* middle of list */
-        q->next->prev = q->prev;
-        q->prev->next =  q->next;
-      }
-      free(q);
-      return;
-    }
+    printf("          STOP TIMER: stopping timer at %f\n",simtime);
+  if (*q != NULL) {
+    /* remove this event */
+    removeevent(*q);
+    freeevent(*q);
+    *q = NULL;
+    return;
+  }
   printf("Warning: unable to cancel your timer. It wasn't running.\n");
 }
 
@@ -265,32 +1945,24 @@ void stoptimer(int AorB)
 void starttimer(int AorB, double increment)
 /* A or B is trying to start timer */
 {
-
-  struct event *q;
+  struct event **q = &timers[ENTITY(curflow, AorB)];
   struct event *evptr;
 
   if (TRACE>1)
-    printf("          START TIMER: starting timer at %f\n",time);
+    printf("          START TIMER: starting timer at %f\n",simtime);
   /* be nice: check to see if timer is already started, if so, then  warn */
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next)  
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      printf("Warning: attempt to start a timer that is already started\n");
-      return;
-    }
+  if (*q != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
  
   /* create future event for when timer goes off */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  evptr->evtime =  time + increment;
+  evptr = allocevent();
+  evptr->evtime =  simtime + increment;
   evptr->evtype =  TIMER_INTERRUPT;
-   
- 
-  evptr->eventity = AorB;
+  evptr->eventity = ENTITY(curflow, AorB);
   insertevent(evptr);
+  *q = evptr;
 } 
 
 
@@ -299,27 +1971,56 @@ void tolayer3(int AorB, struct pkt packet)
 /* A or B is sending to network  */
 {
   struct pkt *mypktptr;
-  struct event *evptr,*q;
-  float lastime, x;
+  struct event *evptr;
+  struct netdecision d;
+  float lastime;
   int i;
 
   ntolayer3++;
+#if MULTIHOP
+  /* packet enters the topology at the sender's node */
+  evptr = allocevent();
+  evptr->eventity = PEER(ENTITY(curflow, AorB));
+  evptr->packet = packet;
+  evptr->evhops = 0;
+  if (TRACE>2)
+    printf("          TOLAYER3: seq: %d, ack %d, check: %d entering at node %d\n", packet.seqnum,
+           packet.acknum, packet.checksum, endpoint[AorB]);
+  forward(evptr, endpoint[AorB]);
+  return;
+#endif
+  nextdecision(AorB, &d);
 
   /* simulate losses: */
-  if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+  if (d.lost) {
     nlost++;
     if (TRACE>0)    
       printf("          TOLAYER3: packet being lost\n");
     return;
   }  
 
+  /* drop-tail: the medium shared by all flows only holds linkqueue packets */
+  if (linkqueue > 0) {
+    if (inmedium[MEDIUM(PEER(ENTITY(curflow, AorB)))] >= linkqueue) {
+      nqueuedrops++;
+      if (TRACE>0)    
+        printf("          TOLAYER3: link queue full, packet being dropped\n");
+      return;
+    }
+    inmedium[MEDIUM(PEER(ENTITY(curflow, AorB)))]++;
+  }
+#if SAMPLER
+  ninflight++;
+#endif
+
+  /* create future event for arrival of packet at the other side */
+  evptr = allocevent();
+  evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
+  evptr->eventity = PEER(ENTITY(curflow, AorB)); /* event occurs at other entity */
+
   /* make a copy of the packet student just gave me since he/she may decide */
   /* to do something with the packet after we return back to him/her */ 
-  mypktptr = malloc(sizeof(struct pkt));
-  if (mypktptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
+  mypktptr = &evptr->packet;
   mypktptr->seqnum = packet.seqnum;
   mypktptr->acknum = packet.acknum;
   mypktptr->checksum = packet.checksum;
@@ -333,34 +2034,26 @@ void tolayer3(int AorB, struct pkt packet)
     printf("\n");
   }
 
-  /* create future event for arrival of packet at the other side */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
-  evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
-  evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
   /* finally, compute the arrival time of packet at the other end.
      medium can not reorder, so make sure packet arrives between 1 and 10
      time units after the latest arrival time of packets
-     currently in the medium on their way to the destination */
-  lastime = time;
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) 
-      lastime = q->evtime;
-  evptr->evtime =  lastime + 1 + 9*jimsrand();
+     currently in the medium on their way to the destination.
+     All flows share the medium in each direction, except in the
+     parallel engine. */
+  lastime = simtime;
+  if (lastarrival[MEDIUM(evptr->eventity)] > lastime)
+    lastime = lastarrival[MEDIUM(evptr->eventity)];
+  evptr->evtime =  lastime + 1 + d.jitter;
+  lastarrival[MEDIUM(evptr->eventity)] = evptr->evtime;
  
 
 
   /* simulate corruption: */
-  if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+  if (d.corrupt != CORRUPT_NONE) {
     ncorrupt++;
-    if ( (x = jimsrand()) < .75)
+    if (d.corrupt == CORRUPT_PAYLOAD)
       mypktptr->payload[0]='Z';   /* corrupt payload */
-    else if (x < .875)
+    else if (d.corrupt == CORRUPT_SEQNUM)
       mypktptr->seqnum = 999999;
     else
       mypktptr->acknum = 999999;
@@ -386,93 +2079,797 @@ void tolayer5(int AorB, char datasent[20])
       printf("%c",datasent[i]);
     printf("\n");
   }
+#if VERIFY
+  if (!verifydelivery(ENTITY(curflow, AorB), datasent))
+    return;
+#endif
+#if STEADY
+  steadydelivered(PEER(ENTITY(curflow, AorB)), lastdelivered[ENTITY(curflow, AorB)]);
+#endif
   messages_delivered++;
+  flowdelivered[curflow]++;
 }
 
-int main(void)
+/* per-flow goodput and Jain's fairness index over the flows' goodputs */
+void reportflows(void)
+{
+  double goodput, sum, sumsq, min, max;
+  int i;
+
+  sum = sumsq = 0.0;
+  min = max = (simtime > 0.0) ? flowdelivered[0] / simtime : 0.0;
+  for (i=0; i<nflows; i++) {
+    goodput = (simtime > 0.0) ? flowdelivered[i] / simtime : 0.0;
+    if (nflows <= 20)
+      printf("flow %d: messages delivered %d, goodput %g msgs per time unit\n",i,flowdelivered[i],goodput);
+    sum += goodput;
+    sumsq += goodput*goodput;
+    if (goodput < min)
+      min = goodput;
+    if (goodput > max)
+      max = goodput;
+  }
+  printf("per-flow goodput (msgs per time unit): mean %g, min %g, max %g\n",sum/nflows,min,max);
+  printf("Jain's fairness index over %d flows:  %f \n",nflows,(sumsq > 0.0) ? sum*sum/(nflows*sumsq) : 1.0);
+}
+
+/********************** PROFILE ***********************/
+#if PROFILE
+
+#define  PROF_EVENTS     0          /* one slot per event type */
+#define  PROF_DEQUEUE    4          /* taking events off the event list */
+#define  PROF_CALLEES    5          /* protocol routines called by the emulator */
+#define  PROF_A_OUTPUT   5
+#define  PROF_B_OUTPUT   6
+#define  PROF_A_INPUT    7
+#define  PROF_B_INPUT    8
+#define  PROF_A_TIMER    9
+#define  PROF_B_TIMER    10
+#define  PROF_CALLS      11         /* emulator routines called by the protocol */
+#define  PROF_TOLAYER3   11
+#define  PROF_TOLAYER5   12
+#define  PROF_STARTTIMER 13
+#define  PROF_STOPTIMER  14
+#define  PROF_SLOTS      15
+
+static const char *const profnames[PROF_SLOTS] = {
+  "event: timer interrupt", "event: from layer 5", "event: from layer 3", "event: from link",
+  "event list: dequeue",
+  "A_output", "B_output", "A_input", "B_input", "A_timerinterrupt", "B_timerinterrupt",
+  "tolayer3", "tolayer5", "starttimer", "stoptimer"
+};
+
+static unsigned long long profticks[PROF_SLOTS];
+static unsigned long long profcalls[PROF_SLOTS];
+static unsigned long long profown[PROF_SLOTS];  /* protocol routines less the emulator routines they call */
+static unsigned long long profinner;            /* all the time in emulator routines called by the protocol */
+
+static unsigned long long ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+/* charge the time since start to a slot, and return it */
+static unsigned long long profadd(int slot, unsigned long long start)
+{
+  unsigned long long elapsed = ticks() - start;
+
+  profticks[slot] += elapsed;
+  profcalls[slot]++;
+  if (slot >= PROF_CALLS)
+    profinner += elapsed;
+  return elapsed;
+}
+
+#undef tolayer3
+#undef tolayer5
+#undef starttimer
+#undef stoptimer
+
+void tolayer3(int AorB, struct pkt packet)
+{
+  unsigned long long t = ticks();
+
+  emutolayer3(AorB, packet);
+  profadd(PROF_TOLAYER3, t);
+}
+
+void tolayer5(int AorB, char datasent[20])
+{
+  unsigned long long t = ticks();
+
+  emutolayer5(AorB, datasent);
+  profadd(PROF_TOLAYER5, t);
+}
+
+void starttimer(int AorB, double increment)
+{
+  unsigned long long t = ticks();
+
+  emustarttimer(AorB, increment);
+  profadd(PROF_STARTTIMER, t);
+}
+
+void stoptimer(int AorB)
+{
+  unsigned long long t = ticks();
+
+  emustoptimer(AorB);
+  profadd(PROF_STOPTIMER, t);
+}
+
+/* timed versions of the protocol routines, for the dispatch tables */
+#define  PROFILED(routine, slot, params, args)                  \
+  static void prof##routine params                              \
+  {                                                             \
+    unsigned long long inner = profinner;                       \
+    unsigned long long t = ticks();                             \
+                                                                \
+    routine args;                                               \
+    profown[slot] += profadd(slot, t) - (profinner - inner);    \
+  }
+
+PROFILED(A_output, PROF_A_OUTPUT, (struct msg message), (message))
+PROFILED(B_output, PROF_B_OUTPUT, (struct msg message), (message))
+PROFILED(A_input, PROF_A_INPUT, (struct pkt packet), (packet))
+PROFILED(B_input, PROF_B_INPUT, (struct pkt packet), (packet))
+PROFILED(A_timerinterrupt, PROF_A_TIMER, (void), ())
+PROFILED(B_timerinterrupt, PROF_B_TIMER, (void), ())
+
+/* rows are inclusive: an event's time includes the protocol routine it
+   calls, which includes the emulator routines the protocol calls.  The
+   "own code" rows take those out, e.g. the cost of handling an ACK */
+static void reportprofile(void)
+{
+  unsigned long long total, events, callees, calls;
+  int i;
+
+  events = callees = calls = 0;
+  for (i=PROF_EVENTS; i<PROF_DEQUEUE; i++)
+    events += profticks[i];
+  for (i=PROF_CALLEES; i<PROF_CALLS; i++)
+    callees += profticks[i];
+  for (i=PROF_CALLS; i<PROF_SLOTS; i++)
+    calls += profticks[i];
+  total = events + profticks[PROF_DEQUEUE];
+  if (total == 0)
+    return;
+
+#if defined(__x86_64__) || defined(__i386__)
+  printf("\n%-26s %12s %16s %7s %12s\n", "profile", "calls", "cycles", "%", "cycles/call");
+#else
+  printf("\n%-26s %12s %16s %7s %12s\n", "profile", "calls", "ns", "%", "ns/call");
+#endif
+  for (i=0; i<PROF_SLOTS; i++)
+    if (profcalls[i] > 0)
+      printf("%-26s %12llu %16llu %7.2f %12.1f\n", profnames[i], profcalls[i], profticks[i],
+             100.0 * profticks[i] / total, (double)profticks[i] / profcalls[i]);
+  for (i=PROF_CALLEES; i<PROF_CALLS; i++)
+    if (profcalls[i] > 0)
+      printf("%-16s own code  %12llu %16llu %7.2f %12.1f\n", profnames[i], profcalls[i], profown[i],
+             100.0 * profown[i] / total, (double)profown[i] / profcalls[i]);
+  printf("%-26s %12s %16llu %7.2f\n", "emulator outside protocol", "",
+         events + profticks[PROF_DEQUEUE] - callees, 100.0 * (total - callees) / total);
+  printf("%-26s %12s %16llu %7.2f\n", "protocol, own code", "",
+         callees - calls, 100.0 * (callees - calls) / total);
+  printf("%-26s %12s %16llu %7.2f\n", "emulator called by protocol", "",
+         calls, 100.0 * calls / total);
+}
+
+#endif
+
+/********************** EVENT DISPATCH ***********************/
+/* one handler per event type, and one student routine per side */
+
+#if PROFILE
+static void (*const outputs[2])(struct msg) = { profA_output, profB_output };
+static void (*const inputs[2])(struct pkt) = { profA_input, profB_input };
+static void (*const timerinterrupts[2])(void) = { profA_timerinterrupt, profB_timerinterrupt };
+#else
+static void (*const outputs[2])(struct msg) = { A_output, B_output };
+static void (*const inputs[2])(struct pkt) = { A_input, B_input };
+static void (*const timerinterrupts[2])(void) = { A_timerinterrupt, B_timerinterrupt };
+#endif
+
+#if PARALLEL
+static int *flownsim;         /* messages generated so far by each flow */
+
+/* each flow generates its share of the messages */
+static int flowquota(int flow)
+{
+  return nsimmax / nflows + (flow < nsimmax % nflows);
+}
+#endif
+
+static void fromlayer5(struct event *eventptr)
 {
-  struct event *eventptr;
   struct msg  msg2give;
-  struct pkt  pkt2give;
-   
   int i,j;
+
+#if PARALLEL
+  if (flownsim[curflow] < flowquota(curflow)) {
+    generate_next_arrival(curflow);   /* set up future arrival */
+    /* fill in msg to give with string of same letter */    
+    j = flownsim[curflow]++ % 26;
+#else
+  if (nsim < nsimmax) {
+    generate_next_arrival(curflow);   /* set up future arrival */
+    /* fill in msg to give with string of same letter */    
+    j = nsim % 26; 
+#endif
+    for (i=0; i<20; i++)  
+      msg2give.data[i] = 97 + j;
+#if STEADY
+    steadygenerated(eventptr->eventity, msgid[eventptr->eventity]);
+#endif
+#if VERIFY
+    stampmessage(msg2give.data, msgid[eventptr->eventity]++);
+#endif
+    if (TRACE>2) {
+      printf("          MAINLOOP: data given to student: ");
+      for (i=0; i<20; i++) 
+        printf("%c", msg2give.data[i]);
+      printf("\n");
+    }
+    nsim++;
+    outputs[SIDEOF(eventptr->eventity)](msg2give);
+  }
+  else if (TRACE > 2)
+    printf("          FROM_LAYER5: no more messages to send: \n");
+}
+
+static void fromlayer3(struct event *eventptr)
+{
+  if (linkqueue > 0)
+    inmedium[MEDIUM(eventptr->eventity)]--;
+#if SAMPLER
+  ninflight--;
+#endif
+  /* deliver packet by calling appropriate entity */
+  inputs[SIDEOF(eventptr->eventity)](eventptr->packet);
+}
+
+#if MULTIHOP
+static void fromlink(struct event *eventptr)
+{
+  struct event *evptr;
+
+  links[eventptr->evlink].queued--;
+  if (eventptr->evnode == endpoint[SIDEOF(eventptr->eventity)]) {
+    /* deliver packet by calling appropriate entity */
+    inputs[SIDEOF(eventptr->eventity)](eventptr->packet);
+    return;
+  }
+  evptr = allocevent();          /* eventptr is freed once handled */
+  *evptr = *eventptr;
+  forward(evptr, eventptr->evnode);
+}
+#endif
+
+static void timerinterrupt(struct event *eventptr)
+{
+  timers[eventptr->eventity] = NULL;
+  timerinterrupts[SIDEOF(eventptr->eventity)]();
+}
+
+static void (*const handlers[NEVENTTYPES])(struct event *) = {
+  timerinterrupt,      /* TIMER_INTERRUPT */
+  fromlayer5,          /* FROM_LAYER5 */
+  fromlayer3,          /* FROM_LAYER3 */
+#if MULTIHOP
+  fromlink             /* FROM_LINK */
+#endif
+};
+
+/* simulate an event taken off the event list, then free it */
+static void handleevent(struct event *eventptr)
+{
+  if (TRACE>=2) {
+    printf("\nEVENT time: %f,",eventptr->evtime);
+    printf("  type: %d",eventptr->evtype);
+    if (eventptr->evtype==0)
+      printf(", timerinterrupt  ");
+    else if (eventptr->evtype==1)
+      printf(", fromlayer5 ");
+    else if (eventptr->evtype==2)
+      printf(", fromlayer3 ");
+    else
+      printf(", fromlink %d ",eventptr->evnode);
+    printf(" entity: %d\n",eventptr->eventity);
+  }
+  simtime = eventptr->evtime;        /* update time to next event time */
+  curflow = FLOWOF(eventptr->eventity);
+  curentity = eventptr->eventity;
+  if (eventptr->evtype >= 0 && eventptr->evtype < NEVENTTYPES) {
+#if PROFILE
+    unsigned long long t = ticks();
+
+    handlers[eventptr->evtype](eventptr);
+    profadd(PROF_EVENTS + eventptr->evtype, t);
+#else
+    handlers[eventptr->evtype](eventptr);
+#endif
+  }
+  else  {
+    printf("INTERNAL PANIC: unknown event type \n");
+  }
+  freeevent(eventptr);
+}
+
+/********************** PARALLEL ENGINE ***********************/
+#if PARALLEL
+
+struct totals {             /* statistics of a run, summed over the workers */
+  int window_full;
+  int total_ACKs_received;
+  int packets_resent;
+  int new_ACKs;
+  int packets_received;
+  int packets_lost;
+  int packets_corrupt;
+  int packets_sent;
+  int packets_timeout;
+  int messages_delivered;
+  int nsim;
+  int ntolayer3;
+  int nlost;
+  int ncorrupt;
+#if VERIFY
+  int nmisordered;
+  int nmangled;
+  int nskipped;
+#endif
+#if SENDQUEUE
+  int messages_queued;
+  int messages_dequeued;
+  int queue_high_watermarks;
+  int queue_low_watermarks;
+  double queueing_delay;
+  float max_queueing_delay;
+#endif
+#if NAKS
+  int naks_sent;
+  int naks_received;
+  int nak_resends;
+#endif
+#if FEC
+  int parity_sent;
+  int packets_rebuilt;
+#endif
+  float simtime;
+};
+
+static struct totals totals;
+static pthread_mutex_t totalslock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t windowbarrier;
+static float *nexttime;          /* time of the next event of each worker, -1 if none */
+
+/* schedule the first message of each flow whose A this thread simulates */
+static void startarrivals(void)
+{
+  int e;
+
+  for (e = self; e < 2*nflows; e += nworkers)
+    if (SIDEOF(e) == A) {
+      curflow = FLOWOF(e);
+      curentity = e;
+      generate_next_arrival(curflow);
+    }
+}
+
+/* add this thread's statistics to the totals, and free its events */
+static void addtotals(void)
+{
+  struct event *p;
+
+  pthread_mutex_lock(&totalslock);
+  totals.window_full += window_full;
+  totals.total_ACKs_received += total_ACKs_received;
+  totals.packets_resent += packets_resent;
+  totals.new_ACKs += new_ACKs;
+  totals.packets_received += packets_received;
+  totals.packets_lost += packets_lost;
+  totals.packets_corrupt += packets_corrupt;
+  totals.packets_sent += packets_sent;
+  totals.packets_timeout += packets_timeout;
+  totals.messages_delivered += messages_delivered;
+  totals.nsim += nsim;
+  totals.ntolayer3 += ntolayer3;
+  totals.nlost += nlost;
+  totals.ncorrupt += ncorrupt;
+#if SENDQUEUE
+  totals.messages_queued += messages_queued;
+  totals.messages_dequeued += messages_dequeued;
+  totals.queue_high_watermarks += queue_high_watermarks;
+  totals.queue_low_watermarks += queue_low_watermarks;
+  totals.queueing_delay += queueing_delay;
+  if (max_queueing_delay > totals.max_queueing_delay)
+    totals.max_queueing_delay = max_queueing_delay;
+#endif
+#if NAKS
+  totals.naks_sent += naks_sent;
+  totals.naks_received += naks_received;
+  totals.nak_resends += nak_resends;
+#endif
+#if FEC
+  totals.parity_sent += parity_sent;
+  totals.packets_rebuilt += packets_rebuilt;
+#endif
+#if VERIFY
+  totals.nmisordered += nmisordered;
+  totals.nmangled += nmangled;
+  totals.nskipped += nskipped;
+#endif
+  if (simtime > totals.simtime)
+    totals.simtime = simtime;
+  pthread_mutex_unlock(&totalslock);
+
+  while ((p = freeevents) != NULL) {
+    freeevents = p->next;
+    free(p);
+  }
+  free(evlist);
+  evlist = NULL;
+  nevents = maxevents = 0;
+}
+
+/* simulate the entities of one worker.  Events for the entities of other
+   workers are put in the outboxes and handed over at the start of the next
+   window; a window ends 1 time unit (the smallest delay of the medium)
+   after the earliest event of all workers, so none of them can be late */
+static void *worker(void *arg)
+{
+  struct event *p, *q;
+  float t;
+  int w;
+
+  self = (int)(long)arg;
+  startarrivals();
+  while (1) {
+    pthread_barrier_wait(&windowbarrier);    /* outboxes are complete */
+    for (w = 0; w < nworkers; w++) {
+      for (p = outbox[w*nworkers + self]; p != NULL; p = q) {
+        q = p->next;
+        heapinsert(p);
+      }
+      outbox[w*nworkers + self] = NULL;
+    }
+    nexttime[self] = (nevents > 0) ? evlist[0]->evtime : -1.0;
+    pthread_barrier_wait(&windowbarrier);    /* nexttime is complete */
+
+    t = -1.0;
+    for (w = 0; w < nworkers; w++)
+      if (nexttime[w] >= 0.0 && (t < 0.0 || nexttime[w] < t))
+        t = nexttime[w];
+    if (t < 0.0)
+      break;                                 /* no events left anywhere */
+    t = t + 1;
+    while (nevents > 0 && evlist[0]->evtime < t) {
+      p = evlist[0];
+      removeevent(p);
+      handleevent(p);
+    }
+  }
+
+  addtotals();
+  return NULL;
+}
+
+/* start every flow afresh, for a run by n workers */
+static void resetflows(int n)
+{
+  int i;
+
+  nworkers = n;
+  memset(&totals, 0, sizeof(totals));
+  for (i=0; i<2*nflows; i++) {
+    entityrng[i] = 9999 + i;
+    entityseq[i] = 0;
+    timers[i] = NULL;
+    lastarrival[i] = 0.0;
+#if VERIFY
+    msgid[i] = 0;
+    lastdelivered[i] = -1;
+#endif
+  }
+  for (i=0; i<nflows; i++) {
+    flownsim[i] = 0;
+    flowdelivered[i] = 0;
+#if TRAFFIC
+    burstleft[i] = 0;
+#endif
+    curflow = i;
+    A_init();
+    B_init();
+  }
+}
+
+/* simulate all the flows with the plain serial event loop, taking every
+   event in order with no windows or outboxes, and return the wall clock
+   time taken.  This is the reference the workers must agree with */
+static double runserial(void)
+{
+  struct timespec start, end;
+  struct event *p;
+
+  resetflows(1);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  self = 0;
+  startarrivals();
+  while ((p = nextevent()) != NULL) {
+    removeevent(p);
+    handleevent(p);
+  }
+  addtotals();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* simulate all the flows with n workers, return the wall clock time taken */
+static double runparallel(int n)
+{
+  pthread_t *threads;
+  struct timespec start, end;
+  int i;
+
+  resetflows(n);
+  threads = malloc(n * sizeof(pthread_t));
+  outbox = calloc(n * n, sizeof(struct event *));
+  nexttime = malloc(n * sizeof(float));
+  if (threads == 0 || outbox == 0 || nexttime == 0) {
+    printf("memory allocation for workers failed.");
+    exit(EXIT_FAILURE);
+  }
+  pthread_barrier_init(&windowbarrier, NULL, n);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i=0; i<n; i++)
+    if (pthread_create(&threads[i], NULL, worker, (void *)(long)i) != 0) {
+      printf("could not start worker thread %d.\n", i);
+      exit(EXIT_FAILURE);
+    }
+  for (i=0; i<n; i++)
+    pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_barrier_destroy(&windowbarrier);
+  free(threads);
+  free(outbox);
+  free(nexttime);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* do two runs agree?  The counters must match exactly, and so must the
+   maxima, which do not depend on the order the workers report in.  The
+   queueing delays are summed per worker, in whatever order the workers
+   finish, so that sum may differ in its last bits */
+static int sametotals(struct totals *a, struct totals *b)
+{
+  if (a->window_full != b->window_full ||
+      a->total_ACKs_received != b->total_ACKs_received ||
+      a->packets_resent != b->packets_resent ||
+      a->new_ACKs != b->new_ACKs ||
+      a->packets_received != b->packets_received ||
+      a->packets_lost != b->packets_lost ||
+      a->packets_corrupt != b->packets_corrupt ||
+      a->packets_sent != b->packets_sent ||
+      a->packets_timeout != b->packets_timeout ||
+      a->messages_delivered != b->messages_delivered ||
+      a->nsim != b->nsim ||
+      a->ntolayer3 != b->ntolayer3 ||
+      a->nlost != b->nlost ||
+      a->ncorrupt != b->ncorrupt)
+    return 0;
+#if VERIFY
+  if (a->nmisordered != b->nmisordered ||
+      a->nmangled != b->nmangled ||
+      a->nskipped != b->nskipped)
+    return 0;
+#endif
+#if SENDQUEUE
+  if (a->messages_queued != b->messages_queued ||
+      a->messages_dequeued != b->messages_dequeued ||
+      a->queue_high_watermarks != b->queue_high_watermarks ||
+      a->queue_low_watermarks != b->queue_low_watermarks ||
+      a->max_queueing_delay != b->max_queueing_delay)
+    return 0;
+  if (fabs(a->queueing_delay - b->queueing_delay) > 1e-9 * fabs(b->queueing_delay))
+    return 0;
+#endif
+#if NAKS
+  if (a->naks_sent != b->naks_sent ||
+      a->naks_received != b->naks_received ||
+      a->nak_resends != b->nak_resends)
+    return 0;
+#endif
+#if FEC
+  if (a->parity_sent != b->parity_sent ||
+      a->packets_rebuilt != b->packets_rebuilt)
+    return 0;
+#endif
+  return a->simtime == b->simtime;
+}
+
+/* run the serial event loop, then 1, 2, 4 ... workers, check every run
+   gives the same results as the serial one, and report the speedup.
+   Each flow has its own medium and random numbers here, so the serial run
+   is the MULTIFLOW engine's event loop on that model; the MULTIFLOW build
+   itself shares the medium and one random stream between flows, and can
+   only agree with it on average */
+static void parallelsweep(void)
+{
+  struct totals reference;
+  double wall, serial;
+  int n;
+
+  entityrng = malloc(2*nflows * sizeof(unsigned long long));
+  entityseq = malloc(2*nflows * sizeof(unsigned long long));
+  flownsim = malloc(nflows * sizeof(int));
+  if (entityrng == 0 || entityseq == 0 || flownsim == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("\nworkers  wall time (s)  speedup  results\n");
+  serial = runserial();
+  memcpy(&reference, &totals, sizeof(totals));
+  printf(" serial %14.3f %8.2f  reference\n", serial, 1.0);
+  for (n = 1; n <= maxworkers; n = (n < maxworkers && 2*n > maxworkers) ? maxworkers : 2*n) {
+    wall = runparallel(n);
+    printf("%7d %14.3f %8.2f  %s\n", n, wall, (wall > 0.0) ? serial / wall : 0.0,
+           sametotals(&totals, &reference) ? "same as serial" : "DIFFERENT");
+    if (n == maxworkers)
+      break;
+  }
+  printf("\n");
+
+  window_full = reference.window_full;
+  total_ACKs_received = reference.total_ACKs_received;
+  packets_resent = reference.packets_resent;
+  new_ACKs = reference.new_ACKs;
+  packets_received = reference.packets_received;
+  packets_lost = reference.packets_lost;
+  packets_corrupt = reference.packets_corrupt;
+  packets_sent = reference.packets_sent;
+  packets_timeout = reference.packets_timeout;
+  messages_delivered = reference.messages_delivered;
+  nsim = reference.nsim;
+  ntolayer3 = reference.ntolayer3;
+  nlost = reference.nlost;
+  ncorrupt = reference.ncorrupt;
+#if SENDQUEUE
+  messages_queued = reference.messages_queued;
+  messages_dequeued = reference.messages_dequeued;
+  queue_high_watermarks = reference.queue_high_watermarks;
+  queue_low_watermarks = reference.queue_low_watermarks;
+  queueing_delay = reference.queueing_delay;
+  max_queueing_delay = reference.max_queueing_delay;
+#endif
+#if NAKS
+  naks_sent = reference.naks_sent;
+  naks_received = reference.naks_received;
+  nak_resends = reference.nak_resends;
+#endif
+#if FEC
+  parity_sent = reference.parity_sent;
+  packets_rebuilt = reference.packets_rebuilt;
+#endif
+#if VERIFY
+  nmisordered = reference.nmisordered;
+  nmangled = reference.nmangled;
+  nskipped = reference.nskipped;
+#endif
+  simtime = reference.simtime;
+}
+
+#endif
+
+int main(void)
+{
+  struct event *eventptr;
+  int i;
   
   init();
-  A_init();
-  B_init();
+#if PARALLEL
+  parallelsweep();
+  goto terminate;
+#endif
+  for (i=0; i<nflows; i++) {
+    curflow = i;
+    A_init();
+    B_init();
+  }
    
   while (1) {
-    eventptr = evlist;            /* get next event to simulate */
+#if SNAPSHOT
+    if (branchdue())
+      branch();
+#endif
+#if PROFILE
+    unsigned long long t = ticks();
+#endif
+    eventptr = nextevent();       /* get next event to simulate */
     if (eventptr==NULL)
       goto terminate;
-    evlist = evlist->next;        /* remove this event from event list */
-    if (evlist!=NULL)
-      evlist->prev=NULL;
-    if (TRACE>=2) {
-      printf("\nEVENT time: %f,",eventptr->evtime);
-      printf("  type: %d",eventptr->evtype);
-      if (eventptr->evtype==0)
-        printf(", timerinterrupt  ");
-      else if (eventptr->evtype==1)
-        printf(", fromlayer5 ");
-      else
-        printf(", fromlayer3 ");
-      printf(" entity: %d\n",eventptr->eventity);
-    }
-    time = eventptr->evtime;        /* update time to next event time */
-    if (eventptr->evtype == FROM_LAYER5 ) {
-      if (nsim < nsimmax) {
-        generate_next_arrival();   /* set up future arrival */
-        /* fill in msg to give with string of same letter */    
-        j = nsim % 26; 
-        for (i=0; i<20; i++)  
-          msg2give.data[i] = 97 + j;
-        if (TRACE>2) {
-          printf("          MAINLOOP: data given to student: ");
-          for (i=0; i<20; i++) 
-            printf("%c", msg2give.data[i]);
-          printf("\n");
-        }
-        nsim++;
-        if (eventptr->eventity == A) 
-          A_output(msg2give);  
-        else
-          B_output(msg2give);  
-      }
-      else if (TRACE > 2)
-          printf("          FROM_LAYER5: no more messages to send: \n");
-    }
-    else if (eventptr->evtype ==  FROM_LAYER3) {
-      pkt2give.seqnum = eventptr->pktptr->seqnum;
-      pkt2give.acknum = eventptr->pktptr->acknum;
-      pkt2give.checksum = eventptr->pktptr->checksum;
-      for (i=0; i<20; i++)  
-        pkt2give.payload[i] = eventptr->pktptr->payload[i];
-	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-        A_input(pkt2give);            /* appropriate entity */
-      else
-        B_input(pkt2give);
-	    free(eventptr->pktptr);          /* free the memory for packet */
-    }
-    else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-      if (eventptr->eventity == A) 
-        A_timerinterrupt();
-      else
-        B_timerinterrupt();
-    }
-    else  {
-      printf("INTERNAL PANIC: unknown event type \n");
-    }
-    free(eventptr);
+#if SAMPLER
+    if (sampleinterval > 0.0)
+      sampleto(eventptr->evtime);
+#endif
+#if STEADY
+    if (steadyto(eventptr->evtime))
+      goto terminate;
+#endif
+    removeevent(eventptr);        /* remove this event from event list */
+#if PROFILE
+    profadd(PROF_DEQUEUE, t);
+#endif
+    handleevent(eventptr);
   }
 
  terminate:
-  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",time,nsim);
+#if NETLOG
+  closenetlog();
+#endif
+#if SAMPLER
+  writesamples();
+#endif
+#if SNAPSHOT
+  if (branched) {
+    finishbranch();
+    return EXIT_SUCCESS;
+  }
+#endif
+  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",simtime,nsim);
   printf("number of messages dropped due to full window:  %d \n", window_full);
   printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
   printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
   printf("number of packet resends by A:  %d \n", packets_resent);
   printf("number of correct packets received at B:  %d \n", packets_received);
   printf("number of messages delivered to application:  %d \n", messages_delivered);
+#if SENDQUEUE
+  printf("number of messages queued while the window was full:  %d, of which sent:  %d \n",
+         messages_queued, messages_dequeued);
+  printf("average queueing delay of sent messages:  %f, maximum:  %f \n",
+         (messages_dequeued > 0) ? queueing_delay / messages_dequeued : 0.0, max_queueing_delay);
+  printf("number of times a send queue reached its high watermark:  %d, its low watermark:  %d \n",
+         queue_high_watermarks, queue_low_watermarks);
+#endif
+#if NAKS
+  printf("number of NAKs sent by B:  %d, received at A:  %d \n", naks_sent, naks_received);
+  printf("number of packet resends triggered by a NAK:  %d, by a timeout:  %d \n",
+         nak_resends, packets_resent - nak_resends);
+#endif
+#if FEC
+  printf("number of parity packets sent by A:  %d, packets rebuilt from them at B:  %d \n",
+         parity_sent, packets_rebuilt);
+#endif
+#if VERIFY
+  printf("number of deliveries duplicated or out of order:  %d \n", nmisordered);
+  printf("number of deliveries not as sent:  %d \n", nmangled);
+  printf("number of messages never delivered between delivered ones:  %d \n", nskipped);
+#endif
+#if MULTIHOP
+  reporthops();
+#endif
+#if TRAFFIC
+  reporttraffic();
+#endif
+#if PROFILE
+  reportprofile();
+#endif
+#if STEADY
+  reportsteady();
+#endif
+  if (nflows > 1) {
+    printf("number of packets dropped at the full link queue:  %d \n", nqueuedrops);
+    reportflows();
+  }
   return EXIT_SUCCESS;
 }
\ No newline at end of file
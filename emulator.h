@@ -1,11 +1,60 @@
 extern int TRACE;
 
+/* the parallel engine (emulator.c built with -DPARALLEL=1) keeps one copy */
+/* of the statistics below in each worker thread, and adds them up at the end */
+#ifndef PARALLEL
+#define PARALLEL 0
+#endif
+#if PARALLEL
+#define EMU_LOCAL __thread
+#else
+#define EMU_LOCAL
+#endif
+
 /* statistics updated by GBN */
-extern int total_ACKs_received;
-extern int packets_resent;       /* count of the number of packets resent  */
-extern int new_ACKs;      /* count of the number of acks correctly received */
-extern int packets_received;  /* count of the packets received by receiver */
-extern int window_full; /* count of the number of messages dropped due to full window */
+extern EMU_LOCAL int total_ACKs_received;
+extern EMU_LOCAL int packets_resent;       /* count of the number of packets resent  */
+extern EMU_LOCAL int new_ACKs;      /* count of the number of acks correctly received */
+extern EMU_LOCAL int packets_received;  /* count of the packets received by receiver */
+extern EMU_LOCAL int window_full; /* count of the number of messages dropped due to full window */
+
+/* gbn.c and sr.c built with -DSENDQUEUE=n hold up to n messages from layer */
+/* 5 while the window is full, instead of dropping them; build emulator.c  */
+/* with the same setting to report on the queue */
+#ifndef SENDQUEUE
+#define SENDQUEUE 0
+#endif
+#if SENDQUEUE
+extern EMU_LOCAL int messages_queued;       /* messages that waited for room in the window */
+extern EMU_LOCAL int messages_dequeued;     /* of which were sent */
+extern EMU_LOCAL int queue_high_watermarks; /* times a queue filled to three quarters */
+extern EMU_LOCAL int queue_low_watermarks;  /* times it then drained to a quarter */
+extern EMU_LOCAL double queueing_delay;     /* total time sent messages spent queued */
+extern EMU_LOCAL float max_queueing_delay;
+#endif
+
+/* sr.c built with -DNAKS=1 has B ask for the packets missing before one */
+/* that arrives out of order, and A resend them at once; build emulator.c */
+/* with the same setting to report on them */
+#ifndef NAKS
+#define NAKS 0
+#endif
+#if NAKS
+extern EMU_LOCAL int naks_sent;      /* NAKs sent by B */
+extern EMU_LOCAL int naks_received;  /* uncorrupted NAKs received at A */
+extern EMU_LOCAL int nak_resends;    /* packets resent because of a NAK */
+#endif
+
+/* gbn.c and sr.c built with -DFEC=k send a parity packet, the XOR of the */
+/* payloads, after every k new packets, from which B can rebuild one lost */
+/* packet of the k; build emulator.c with the same setting to report it  */
+#ifndef FEC
+#define FEC 0
+#endif
+#if FEC
+extern EMU_LOCAL int parity_sent;      /* parity packets sent by A */
+extern EMU_LOCAL int packets_rebuilt;  /* packets B rebuilt from a parity packet */
+#endif
 
 #define   A    0
 #define   B    1
@@ -38,3 +87,23 @@ extern void starttimer(int, double);
 
 /* stop timer at A or B (int) */
 extern void stoptimer(int);               
+
+/* flow whose event is being handled (0 .. numflows()-1).  A and B above */
+/* always refer to the sender and receiver of the current flow.          */
+extern int currentflow(void);
+
+/* number of flows (A/B pairs) sharing the emulated link */
+extern int numflows(void);
+
+/* simulated time now */
+extern float currenttime(void);
+
+/* emulator.c built with -DSAMPLER=1 samples the protocol state through */
+/* these, which gbn.c and sr.c then provide (built the same way) */
+#ifndef SAMPLER
+#define SAMPLER 0
+#endif
+#if SAMPLER
+extern int A_windowdepth(int flow);    /* packets in A's window */
+extern int B_bufferdepth(int flow);    /* packets held out of order by B */
+#endif
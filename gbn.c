@@ -27,6 +27,28 @@
                           MUST BE SET TO 6 when submitting assignment */
 #define SEQSPACE 7      /* the min sequence space for GBN must be at least windowsize + 1 */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
+#include "window.h"
+
+/* compile with -DPACER=1 to pace A with a token bucket: new packets and
+   retransmissions leave at most PACERATE per time unit, in bursts of up
+   to PACEBURST, instead of back to back.  The pacer's timer and the
+   retransmission timer share A's one timer. */
+#ifndef PACER
+#define PACER 0
+#endif
+#ifndef PACERATE
+#define PACERATE 0.2
+#endif
+#ifndef PACEBURST
+#define PACEBURST 2
+#endif
+#define NOTIMER (-1.0)  /* deadline of a logical timer that is not running */
+#if FEC
+#if FEC > SEQSPACE
+#error "a parity group must not span more than the sequence space"
+#endif
+#define PARITYFLAG (-3) /* seqnum of the parity packet of parity group acknum */
+#endif
 
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your
@@ -57,47 +79,242 @@ bool IsCorrupted(struct pkt packet)
 
 /********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+/* cumulative ACK: drop the packets up to and including seq from the
+   window.  Returns how many, 0 if seq is not in the window */
+static int windowackto(struct window *w, int seq)
+{
+  int n = windowfind(w, seq) + 1;
 
-/* called from layer 5 (application layer), passed the message to be sent to other side */
-void A_output(struct msg message)
+  windowdrop(w, n);
+  return n;
+}
+
+struct sender {
+  struct window window;           /* packets waiting for ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+#if SENDQUEUE
+  struct msg queue[SENDQUEUE];    /* messages waiting for room in the window */
+  float queuedat[SENDQUEUE];      /* time each of them was queued */
+  int queuefirst, queuecount;     /* index of the oldest queued message, and how many */
+  int backpressure;               /* queue went over the high watermark, not yet back to the low */
+#endif
+#if PACER
+  float tokens;                   /* packets the pacer may send now */
+  float refilled;                 /* time the tokens were last topped up */
+  int nextsend;                   /* window offset of the next packet to go out */
+  int sentupto;                   /* window offset of the first packet never sent */
+  float rtxdeadline;              /* retransmission timer, or NOTIMER */
+  float pacedeadline;             /* pacer timer, or NOTIMER */
+  float timerdeadline;            /* when A's timer is set to go off, or NOTIMER */
+#endif
+#if FEC
+  int newpackets;                 /* packets made so far, FEC to a parity group */
+  int paritycount;                /* packets sent in the current group */
+  char parity[20];                /* XOR of their payloads */
+#endif
+};
+
+static struct sender *senders;    /* sender state of each flow */
+
+#if FEC
+/* sequence number of the first packet of a parity group */
+static int groupfirst(int group)
+{
+  return WRAP(WRAP(group, SEQSPACE) * FEC, SEQSPACE);
+}
+
+/* add the first transmission of a packet to the parity of its group, and
+   send the parity after the last packet of the group */
+static void addparity(struct sender *s, struct pkt *p)
+{
+  struct pkt parity;
+  int i;
+
+  for (i=0; i<20; i++)
+    s->parity[i] ^= p->payload[i];
+  if (++s->paritycount < FEC)
+    return;
+
+  parity.seqnum = PARITYFLAG;
+  parity.acknum = p->acknum;
+  for (i=0; i<20; i++) {
+    parity.payload[i] = s->parity[i];
+    s->parity[i] = 0;
+  }
+  parity.checksum = ComputeChecksum(parity);
+  if (TRACE > 0)
+    printf("Sending parity of group %d to layer 3\n", parity.acknum);
+  tolayer3(A, parity);
+  parity_sent++;
+  s->paritycount = 0;
+}
+#endif
+
+#if PACER
+/* set A's timer for the earlier of the retransmission and pacer timers */
+static void armtimer(struct sender *s)
+{
+  float deadline = s->rtxdeadline;
+
+  if (deadline == NOTIMER || (s->pacedeadline != NOTIMER && s->pacedeadline < deadline))
+    deadline = s->pacedeadline;
+  if (deadline == s->timerdeadline)
+    return;
+  if (s->timerdeadline != NOTIMER)
+    stoptimer(A);
+  if (deadline != NOTIMER)
+    starttimer(A, deadline - currenttime());
+  s->timerdeadline = deadline;
+}
+
+/* top up the tokens for the time since the last top up */
+static void refill(struct sender *s)
+{
+  float now = currenttime();
+
+  s->tokens += (now - s->refilled) * PACERATE;
+  if (s->tokens > PACEBURST)
+    s->tokens = PACEBURST;
+  s->refilled = now;
+}
+
+/* send the window's unsent packets as far as the tokens allow */
+static void pace(struct sender *s)
+{
+  float now = currenttime();
+  struct pkt *p;
+
+  refill(s);
+
+  while (s->nextsend < s->window.count && s->tokens >= 1.0) {
+    p = windowat(&s->window, s->nextsend);
+    if (s->nextsend < s->sentupto) {
+      if (TRACE > 0)
+        printf ("---A: resending packet %d\n", p->seqnum);
+      packets_resent++;
+    }
+    else if (TRACE > 0)
+      printf("Sending packet %d to layer 3\n", p->seqnum);
+    tolayer3(A, *p);
+#if FEC
+    if (s->nextsend >= s->sentupto)
+      addparity(s, p);
+#endif
+    s->tokens -= 1.0;
+    s->nextsend++;
+    if (s->nextsend > s->sentupto)
+      s->sentupto = s->nextsend;
+    if (s->rtxdeadline == NOTIMER)
+      s->rtxdeadline = now + RTT;
+  }
+
+  /* wake up when the next token is due */
+  if (s->nextsend < s->window.count)
+    s->pacedeadline = now + (1.0 - s->tokens) / PACERATE;
+  else
+    s->pacedeadline = NOTIMER;
+  armtimer(s);
+}
+#endif
+
+/* put a message in the window as a new packet and send it */
+static void sendmessage(struct sender *s, struct msg message)
 {
   struct pkt sendpkt;
   int i;
 
-  /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
-    if (TRACE > 1)
-      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+  /* create packet */
+  sendpkt.seqnum = s->A_nextseqnum;
+#if FEC
+  sendpkt.acknum = s->newpackets++ / FEC;   /* the packet's parity group */
+#else
+  sendpkt.acknum = NOTINUSE;
+#endif
+  for ( i=0; i<20 ; i++ )
+    sendpkt.payload[i] = message.data[i];
+  sendpkt.checksum = ComputeChecksum(sendpkt);
 
-    /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for ( i=0; i<20 ; i++ )
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt);
+  /* put packet in window buffer */
+  windowpush(&s->window, sendpkt);
 
-    /* put packet in window buffer */
-    /* windowlast will always be 0 for alternating bit; but not for GoBackN */
-    windowlast = (windowlast + 1) % WINDOWSIZE;
-    buffer[windowlast] = sendpkt;
-    windowcount++;
+#if PACER
+  /* the pacer sends it out when there is a token for it */
+  pace(s);
+#else
+  /* send out packet */
+  if (TRACE > 0)
+    printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+  tolayer3 (A, sendpkt);
+#if FEC
+  addparity(s, &sendpkt);
+#endif
+
+  /* start timer if first packet in window */
+  if (s->window.count == 1)
+    starttimer(A,RTT);
+#endif
+
+  /* get next sequence number, wrap back to 0 */
+  s->A_nextseqnum = seqnext(s->A_nextseqnum);
+}
 
-    /* send out packet */
-    if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3 (A, sendpkt);
+#if SENDQUEUE
+/* hold a message from layer 5 until the window has room for it */
+static void enqueuemessage(struct sender *s, struct msg message)
+{
+  int last = (s->queuefirst + s->queuecount) % SENDQUEUE;
+
+  s->queue[last] = message;
+  s->queuedat[last] = currenttime();
+  s->queuecount++;
+  messages_queued++;
+  if (!s->backpressure && s->queuecount >= SENDQUEUE - SENDQUEUE/4) {
+    s->backpressure = 1;     /* high watermark: three quarters full */
+    queue_high_watermarks++;
+  }
+}
+
+/* send queued messages, oldest first, while the window has room */
+static void drainqueue(struct sender *s)
+{
+  float delay;
+
+  while (s->queuecount > 0 && !windowfull(&s->window)) {
+    delay = currenttime() - s->queuedat[s->queuefirst];
+    queueing_delay += delay;
+    if (delay > max_queueing_delay)
+      max_queueing_delay = delay;
+    messages_dequeued++;
+    sendmessage(s, s->queue[s->queuefirst]);
+    s->queuefirst = (s->queuefirst + 1) % SENDQUEUE;
+    s->queuecount--;
+    if (s->backpressure && s->queuecount <= SENDQUEUE/4) {
+      s->backpressure = 0;   /* low watermark: a quarter full */
+      queue_low_watermarks++;
+    }
+  }
+}
+#endif
 
-    /* start timer if first packet in window */
-    if (windowcount == 1)
-      starttimer(A,RTT);
+/* called from layer 5 (application layer), passed the message to be sent to other side */
+void A_output(struct msg message)
+{
+  struct sender *s = &senders[currentflow()];
 
-    /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;
+  /* if not blocked waiting on ACK */
+  if (!windowfull(&s->window)) {
+    if (TRACE > 1)
+      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+    sendmessage(s, message);
+  }
+#if SENDQUEUE
+  /* if window is full, wait for room in the send queue */
+  else if (s->queuecount < SENDQUEUE) {
+    if (TRACE > 1)
+      printf("----A: New message arrives, send window is full, queue it\n");
+    enqueuemessage(s, message);
   }
+#endif
   /* if blocked,  window is full */
   else {
     if (TRACE > 0)
@@ -112,8 +329,8 @@ void A_output(struct msg message)
 */
 void A_input(struct pkt packet)
 {
-  int ackcount = 0;
-  int i;
+  struct sender *s = &senders[currentflow()];
+  int ackcount;
 
   /* if received ACK is not corrupted */
   if (!IsCorrupted(packet)) {
@@ -121,41 +338,36 @@ void A_input(struct pkt packet)
       printf("----A: uncorrupted ACK %d is received\n",packet.acknum);
     total_ACKs_received++;
 
-    /* check if new ACK or duplicate */
-    if (windowcount != 0) {
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
-          /* check case when seqnum has and hasn't wrapped */
-          if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
-              ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
-
-            /* packet is a new ACK */
-            if (TRACE > 0)
-              printf("----A: ACK %d is not a duplicate\n",packet.acknum);
-            new_ACKs++;
-
-            /* cumulative acknowledgement - determine how many packets are ACKed */
-            if (packet.acknum >= seqfirst)
-              ackcount = packet.acknum + 1 - seqfirst;
-            else
-              ackcount = SEQSPACE - seqfirst + packet.acknum;
-
-	    /* slide window by the number of packets ACKed */
-            windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
-
-            /* delete the acked packets from window buffer */
-            for (i=0; i<ackcount; i++)
-              windowcount--;
-
-	    /* start timer again if there are still more unacked packets in window */
-            stoptimer(A);
-            if (windowcount > 0)
-              starttimer(A, RTT);
-
-          }
-        }
-        else
-          if (TRACE > 0)
+    /* cumulative acknowledgement - slide the window past the packets ACKed,
+       if the ACK is for a packet in the window and so is not a duplicate */
+    ackcount = windowackto(&s->window, packet.acknum);
+    if (ackcount > 0) {
+
+      /* packet is a new ACK */
+      if (TRACE > 0)
+        printf("----A: ACK %d is not a duplicate\n",packet.acknum);
+      new_ACKs++;
+
+#if PACER
+      /* restart the retransmission timer if packets sent are still unacked */
+      s->nextsend = (s->nextsend > ackcount) ? s->nextsend - ackcount : 0;
+      s->sentupto = (s->sentupto > ackcount) ? s->sentupto - ackcount : 0;
+      s->rtxdeadline = (s->sentupto > 0) ? currenttime() + RTT : NOTIMER;
+      pace(s);
+#else
+      /* start timer again if there are still more unacked packets in window */
+      stoptimer(A);
+      if (s->window.count > 0)
+        starttimer(A, RTT);
+#endif
+
+#if SENDQUEUE
+      /* the window has room again for queued messages */
+      drainqueue(s);
+#endif
+    }
+    else
+      if (s->window.count == 0 && TRACE > 0)
         printf ("----A: duplicate ACK received, do nothing!\n");
   }
   else
@@ -166,54 +378,203 @@ void A_input(struct pkt packet)
 /* called when A's timer goes off */
 void A_timerinterrupt(void)
 {
+  struct sender *s = &senders[currentflow()];
+#if PACER
+  /* the timer went off for the retransmission timer, the pacer, or both */
+  float fired = s->timerdeadline;
+
+  s->timerdeadline = NOTIMER;
+  if (s->rtxdeadline != NOTIMER && s->rtxdeadline <= fired) {
+    if (TRACE > 0)
+      printf("----A: time out,resend packets!\n");
+    s->rtxdeadline = NOTIMER;
+    s->nextsend = 0;              /* go back N, at the pacer's rate */
+  }
+  /* the pacer's token is due, whatever rounding made of the time */
+  refill(s);
+  if (s->pacedeadline != NOTIMER && s->pacedeadline <= fired && s->tokens < 1.0)
+    s->tokens = 1.0;
+  pace(s);
+#else
+  struct pkt *p;
   int i;
 
   if (TRACE > 0)
     printf("----A: time out,resend packets!\n");
 
-  for(i=0; i<windowcount; i++) {
+  WINDOW_FOREACH(&s->window, i, p) {
 
     if (TRACE > 0)
-      printf ("---A: resending packet %d\n", (buffer[(windowfirst+i) % WINDOWSIZE]).seqnum);
+      printf ("---A: resending packet %d\n", p->seqnum);
 
-    tolayer3(A,buffer[(windowfirst+i) % WINDOWSIZE]);
+    tolayer3(A, *p);
     packets_resent++;
     if (i==0) starttimer(A,RTT);
   }
+#endif
 }
 
 
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
+/* It is called once for each flow sharing the link. */
 void A_init(void)
 {
+  struct sender *s;
+#if FEC
+  int i;
+#endif
+
+  if (senders == NULL) {
+    senders = calloc(numflows(), sizeof(struct sender));
+    if (senders == NULL) {
+      printf("memory allocation for sender state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  s = &senders[currentflow()];
+
   /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.
-		     new packets are placed in winlast + 1
-		     so initially this is set to -1
-		   */
-  windowcount = 0;
+  s->A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+  windowinit(&s->window);
+#if SENDQUEUE
+  s->queuefirst = 0;
+  s->queuecount = 0;
+  s->backpressure = 0;
+#endif
+#if PACER
+  s->tokens = PACEBURST;
+  s->refilled = currenttime();
+  s->nextsend = 0;
+  s->sentupto = 0;
+  s->rtxdeadline = NOTIMER;
+  s->pacedeadline = NOTIMER;
+  s->timerdeadline = NOTIMER;
+#endif
+#if FEC
+  s->newpackets = 0;
+  s->paritycount = 0;
+  for (i=0; i<20; i++)
+    s->parity[i] = 0;
+#endif
 }
 
 
 
 /********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+struct receiver {
+  int expectedseqnum; /* the sequence number expected next by the receiver */
+  int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+#if FEC
+  int fecgroup;           /* parity group B is collecting */
+  int fecheard;           /* how many of its packets B has */
+  bool heard[FEC];        /* which ones */
+  char fecdata[FEC][20];  /* and their payloads */
+#endif
+};
+
+static struct receiver *receivers;  /* receiver state of each flow */
+
+#if FEC
+/* start collecting the packets of a parity group */
+static void startgroup(struct receiver *r, int group)
+{
+  int i;
+
+  r->fecgroup = group;
+  r->fecheard = 0;
+  for (i=0; i<FEC; i++)
+    r->heard[i] = false;
+}
+
+/* keep the packets of the group B is collecting, and when the group's
+   parity arrives with one of them missing, rebuild it.  Returns the
+   position in the group of the rebuilt packet, or -1 */
+static int collectgroup(struct receiver *r, struct pkt *packet)
+{
+  int pos, i, j;
+  char x;
+
+  if (packet->acknum < r->fecgroup)   /* a resend from a group already done */
+    return -1;
+  if (packet->acknum > r->fecgroup)   /* the rest of B's group and its parity were lost */
+    startgroup(r, packet->acknum);
+
+  if (packet->seqnum != PARITYFLAG) {
+    pos = seqdistance(packet->seqnum, groupfirst(r->fecgroup));
+    if (pos < FEC && !r->heard[pos]) {
+      for (i=0; i<20; i++)
+        r->fecdata[pos][i] = packet->payload[i];
+      r->heard[pos] = true;
+      r->fecheard++;
+    }
+    return -1;
+  }
+
+  /* the parity ends the group: XOR it with the packets B has to get the one it lacks */
+  if (r->fecheard != FEC - 1)
+    return -1;
+  for (pos=0; r->heard[pos]; pos++)
+    ;
+  for (i=0; i<20; i++) {
+    x = packet->payload[i];
+    for (j=0; j<FEC; j++)
+      if (j != pos)
+        x ^= r->fecdata[j][i];
+    r->fecdata[pos][i] = x;
+  }
+  r->heard[pos] = true;
+  r->fecheard++;
+  packets_rebuilt++;
+  if (TRACE > 0)
+    printf("----B: packet %d is rebuilt from the parity of group %d\n",
+           WRAP(groupfirst(r->fecgroup) + pos, SEQSPACE), r->fecgroup);
+  return pos;
+}
+
+/* packet pos of the group B is collecting, as A sent it */
+static struct pkt grouppacket(struct receiver *r, int pos)
+{
+  struct pkt packet;
+  int i;
+
+  packet.seqnum = WRAP(groupfirst(r->fecgroup) + pos, SEQSPACE);
+  packet.acknum = r->fecgroup;
+  for (i=0; i<20; i++)
+    packet.payload[i] = r->fecdata[pos][i];
+  packet.checksum = ComputeChecksum(packet);
+  return packet;
+}
+#endif
 
 
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 void B_input(struct pkt packet)
 {
+  struct receiver *r = &receivers[currentflow()];
   struct pkt sendpkt;
   int i;
 
+#if FEC
+  if (!IsCorrupted(packet)) {
+    i = collectgroup(r, &packet);
+    if (packet.seqnum == PARITYFLAG) {
+      /* if the rebuilt packet is the one B expects, B can take it and the
+         packets after it in the group, which it discarded as out of order */
+      if (i >= 0 && grouppacket(r, i).seqnum == r->expectedseqnum)
+        for (; i<FEC; i++)
+          B_input(grouppacket(r, i));
+      if (packet.acknum == r->fecgroup)
+        startgroup(r, r->fecgroup + 1);
+      return;
+    }
+  }
+#endif
+
   /* if not corrupted and received packet is in order */
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
+  if  ( (!IsCorrupted(packet))  && (packet.seqnum == r->expectedseqnum) ) {
     if (TRACE > 0)
       printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
     packets_received++;
@@ -222,24 +583,21 @@ void B_input(struct pkt packet)
     tolayer5(B, packet.payload);
 
     /* send an ACK for the received packet */
-    sendpkt.acknum = expectedseqnum;
+    sendpkt.acknum = r->expectedseqnum;
 
     /* update state variables */
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
+    r->expectedseqnum = seqnext(r->expectedseqnum);
   }
   else {
     /* packet is corrupted or out of order resend last ACK */
     if (TRACE > 0)
       printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
-      sendpkt.acknum = SEQSPACE - 1;
-    else
-      sendpkt.acknum = expectedseqnum - 1;
+    sendpkt.acknum = seqprev(r->expectedseqnum);
   }
 
   /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
+  sendpkt.seqnum = r->B_nextseqnum;
+  r->B_nextseqnum = (r->B_nextseqnum + 1) % 2;
 
   /* we don't have any data to send.  fill payload with 0's */
   for ( i=0; i<20 ; i++ )
@@ -254,11 +612,41 @@ void B_input(struct pkt packet)
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
+/* It is called once for each flow sharing the link. */
 void B_init(void)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  struct receiver *r;
+
+  if (receivers == NULL) {
+    receivers = calloc(numflows(), sizeof(struct receiver));
+    if (receivers == NULL) {
+      printf("memory allocation for receiver state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  r = &receivers[currentflow()];
+
+  r->expectedseqnum = 0;
+  r->B_nextseqnum = 1;
+#if FEC
+  startgroup(r, 0);
+#endif
+}
+
+#if SAMPLER
+/* state of a flow for the emulator's sampler */
+int A_windowdepth(int flow)
+{
+  return (senders != NULL) ? senders[flow].window.count : 0;
+}
+
+/* Go-Back-N discards out of order packets, so B never holds any */
+int B_bufferdepth(int flow)
+{
+  (void)flow;
+  return 0;
 }
+#endif
 
 /******************************************************************************
  * The following functions need be completed only for bi-directional messages *
@@ -26,6 +26,21 @@
                           MUST BE SET TO 6 when submitting assignment */
 #define SEQSPACE 12     /* the sequence space for SR must be at least 2 * windowsize */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
+#if SEQSPACE % WINDOWSIZE
+#error "B's buffer slots need SEQSPACE to be a multiple of WINDOWSIZE"
+#endif
+#include "window.h"
+#if NAKS
+#define NAKFLAG (-2)    /* seqnum of a packet from B asking for packet acknum again */
+#define NAKHOLDOFF RTT  /* time before B asks again for the same missing packet */
+#define NOTNAKED (-1.0) /* B has not asked for this packet */
+#endif
+#if FEC
+#if FEC > SEQSPACE
+#error "a parity group must not span more than the sequence space"
+#endif
+#define PARITYFLAG (-3) /* seqnum of the parity packet of parity group acknum */
+#endif
 
 /* Function prototypes to prevent nested function warnings */
 void A_timerinterrupt(void);
@@ -63,51 +78,156 @@ bool IsCorrupted(struct pkt packet)
 
 /********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
-static int acked[SEQSPACE];            /* array to track which packets have been ACKed */
+struct sender {
+  struct window window;           /* packets waiting for ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+  int acked[SEQSPACE];            /* array to track which packets have been ACKed */
+#if SENDQUEUE
+  struct msg queue[SENDQUEUE];    /* messages waiting for room in the window */
+  float queuedat[SENDQUEUE];      /* time each of them was queued */
+  int queuefirst, queuecount;     /* index of the oldest queued message, and how many */
+  int backpressure;               /* queue went over the high watermark, not yet back to the low */
+#endif
+#if FEC
+  int newpackets;                 /* packets made so far, FEC to a parity group */
+  int paritycount;                /* packets sent in the current group */
+  char parity[20];                /* XOR of their payloads */
+#endif
+};
 
-/* called from layer 5 (application layer), passed the message to be sent to other side */
-void A_output(struct msg message)
+static struct sender *senders;    /* sender state of each flow */
+
+#if FEC
+/* sequence number of the first packet of a parity group */
+static int groupfirst(int group)
+{
+  return WRAP(WRAP(group, SEQSPACE) * FEC, SEQSPACE);
+}
+
+/* add the first transmission of a packet to the parity of its group, and
+   send the parity after the last packet of the group */
+static void addparity(struct sender *s, struct pkt *p)
+{
+  struct pkt parity;
+  int i;
+
+  for (i=0; i<20; i++)
+    s->parity[i] ^= p->payload[i];
+  if (++s->paritycount < FEC)
+    return;
+
+  parity.seqnum = PARITYFLAG;
+  parity.acknum = p->acknum;
+  for (i=0; i<20; i++) {
+    parity.payload[i] = s->parity[i];
+    s->parity[i] = 0;
+  }
+  parity.checksum = ComputeChecksum(parity);
+  if (TRACE > 0)
+    printf("Sending parity of group %d to layer 3\n", parity.acknum);
+  tolayer3(A, parity);
+  parity_sent++;
+  s->paritycount = 0;
+}
+#endif
+
+/* put a message in the window as a new packet and send it */
+static void sendmessage(struct sender *s, struct msg message)
 {
   struct pkt sendpkt;
   int i;
 
-  /* if not blocked waiting on ACK */
-  if (windowcount < WINDOWSIZE) {
-    if (TRACE > 1)
-      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+  /* create packet */
+  sendpkt.seqnum = s->A_nextseqnum;
+#if FEC
+  sendpkt.acknum = s->newpackets++ / FEC;   /* the packet's parity group */
+#else
+  sendpkt.acknum = NOTINUSE;
+#endif
+  for (i=0; i<20; i++)
+    sendpkt.payload[i] = message.data[i];
+  sendpkt.checksum = ComputeChecksum(sendpkt);
 
-    /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for (i=0; i<20; i++)
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt);
+  /* put packet in window buffer */
+  windowpush(&s->window, sendpkt);
+  
+  /* track that this packet has not been ACKed yet */
+  s->acked[sendpkt.seqnum] = 0;
 
-    /* put packet in window buffer */
-    windowlast = (windowlast + 1) % WINDOWSIZE;
-    buffer[windowlast] = sendpkt;
-    windowcount++;
-    
-    /* track that this packet has not been ACKed yet */
-    acked[sendpkt.seqnum] = 0;
+  /* send out packet */
+  if (TRACE > 0)
+    printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+  tolayer3(A, sendpkt);
+#if FEC
+  addparity(s, &sendpkt);
+#endif
 
-    /* send out packet */
-    if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3(A, sendpkt);
+  /* start timer for this packet if it's the first one in the window */
+  if (s->window.count == 1) {
+    starttimer(A, RTT);
+  }
+
+  /* get next sequence number, wrap back to 0 */
+  s->A_nextseqnum = seqnext(s->A_nextseqnum);
+}
+
+#if SENDQUEUE
+/* hold a message from layer 5 until the window has room for it */
+static void enqueuemessage(struct sender *s, struct msg message)
+{
+  int last = (s->queuefirst + s->queuecount) % SENDQUEUE;
 
-    /* start timer for this packet if it's the first one in the window */
-    if (windowcount == 1) {
-      starttimer(A, RTT);
+  s->queue[last] = message;
+  s->queuedat[last] = currenttime();
+  s->queuecount++;
+  messages_queued++;
+  if (!s->backpressure && s->queuecount >= SENDQUEUE - SENDQUEUE/4) {
+    s->backpressure = 1;     /* high watermark: three quarters full */
+    queue_high_watermarks++;
+  }
+}
+
+/* send queued messages, oldest first, while the window has room */
+static void drainqueue(struct sender *s)
+{
+  float delay;
+
+  while (s->queuecount > 0 && !windowfull(&s->window)) {
+    delay = currenttime() - s->queuedat[s->queuefirst];
+    queueing_delay += delay;
+    if (delay > max_queueing_delay)
+      max_queueing_delay = delay;
+    messages_dequeued++;
+    sendmessage(s, s->queue[s->queuefirst]);
+    s->queuefirst = (s->queuefirst + 1) % SENDQUEUE;
+    s->queuecount--;
+    if (s->backpressure && s->queuecount <= SENDQUEUE/4) {
+      s->backpressure = 0;   /* low watermark: a quarter full */
+      queue_low_watermarks++;
     }
+  }
+}
+#endif
 
-    /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;
+/* called from layer 5 (application layer), passed the message to be sent to other side */
+void A_output(struct msg message)
+{
+  struct sender *s = &senders[currentflow()];
+
+  /* if not blocked waiting on ACK */
+  if (!windowfull(&s->window)) {
+    if (TRACE > 1)
+      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+    sendmessage(s, message);
   }
+#if SENDQUEUE
+  /* if window is full, wait for room in the send queue */
+  else if (s->queuecount < SENDQUEUE) {
+    if (TRACE > 1)
+      printf("----A: New message arrives, send window is full, queue it\n");
+    enqueuemessage(s, message);
+  }
+#endif
   /* if blocked, window is full */
   else {
     if (TRACE > 0)
@@ -116,11 +236,40 @@ void A_output(struct msg message)
   }
 }
 
+#if NAKS
+/* B is missing packet seqnum: resend it now rather than waiting for the timer */
+static void resendnaked(struct sender *s, int seqnum)
+{
+  int offset = windowfind(&s->window, seqnum);
+
+  naks_received++;
+  if (offset >= 0 && s->acked[seqnum] == 0) {
+    if (TRACE > 0)
+      printf("----A: NAK %d is received, resend packet %d\n", seqnum, seqnum);
+    tolayer3(A, *windowat(&s->window, offset));
+    packets_resent++;
+    nak_resends++;
+  }
+  else if (TRACE > 0)
+    printf("----A: NAK %d is outside the window or already ACKed, do nothing!\n", seqnum);
+}
+#endif
+
 /* called from layer 3, when a packet arrives for layer 4
    In this practical this will always be an ACK as B never sends data.
 */
 void A_input(struct pkt packet)
 {
+  struct sender *s = &senders[currentflow()];
+  int offset, n;
+
+#if NAKS
+  if (packet.seqnum == NAKFLAG && !IsCorrupted(packet)) {
+    resendnaked(s, packet.acknum);
+    return;
+  }
+#endif
+
   /* if received ACK is not corrupted */
   if (!IsCorrupted(packet)) {
     if (TRACE > 0)
@@ -128,28 +277,33 @@ void A_input(struct pkt packet)
     total_ACKs_received++;
 
     /* check if ACK is within current window and not already ACKed */
-    if (windowcount > 0 && acked[packet.acknum] == 0) {
+    offset = windowfind(&s->window, packet.acknum);
+    if (offset >= 0 && s->acked[packet.acknum] == 0) {
       /* Mark this sequence number as ACKed */
-      acked[packet.acknum] = 1;
+      s->acked[packet.acknum] = 1;
       if (TRACE > 0)
         printf("----A: ACK %d is not a duplicate\n", packet.acknum);
       new_ACKs++;
       
       /* Check if this ACK is for the base of the window */
-      if (packet.acknum == buffer[windowfirst].seqnum) {
+      if (offset == 0) {
         /* Stop the timer for this packet */
         stoptimer(A);
         
         /* Slide window over all consecutive ACKed packets */
-        while (windowcount > 0 && acked[buffer[windowfirst].seqnum] == 1) {
-          windowfirst = (windowfirst + 1) % WINDOWSIZE;
-          windowcount--;
-        }
+        for (n = 0; n < s->window.count && s->acked[windowat(&s->window, n)->seqnum] == 1; n++)
+          ;
+        windowdrop(&s->window, n);
         
         /* If there are still unacked packets, restart timer for the new base */
-        if (windowcount > 0) {
+        if (s->window.count > 0) {
           starttimer(A, RTT);
         }
+
+#if SENDQUEUE
+        /* the window has room again for queued messages */
+        drainqueue(s);
+#endif
       }
     }
     else if (TRACE > 0) {
@@ -164,15 +318,17 @@ void A_input(struct pkt packet)
 /* called when A's timer goes off */
 void A_timerinterrupt(void)
 {
+  struct sender *s = &senders[currentflow()];
+
   if (TRACE > 0)
     printf("----A: time out,resend packets!\n");
   
   /* In SR with a single timer, we resend only the oldest unacknowledged packet */
-  if (windowcount > 0) {
+  if (s->window.count > 0) {
     if (TRACE > 0)
-      printf("---A: resending packet %d\n", buffer[windowfirst].seqnum);
+      printf("---A: resending packet %d\n", windowat(&s->window, 0)->seqnum);
     
-    tolayer3(A, buffer[windowfirst]);
+    tolayer3(A, *windowat(&s->window, 0));
     packets_resent++;
     
     /* Restart timer for this packet */
@@ -182,39 +338,185 @@ void A_timerinterrupt(void)
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
+/* It is called once for each flow sharing the link. */
 void A_init(void)
 {
+  struct sender *s;
   int i;
   
+  if (senders == NULL) {
+    senders = calloc(numflows(), sizeof(struct sender));
+    if (senders == NULL) {
+      printf("memory allocation for sender state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  s = &senders[currentflow()];
+
   /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.
-                     new packets are placed in winlast + 1
-                     so initially this is set to -1
-                   */
-  windowcount = 0;
+  s->A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+  windowinit(&s->window);
+#if SENDQUEUE
+  s->queuefirst = 0;
+  s->queuecount = 0;
+  s->backpressure = 0;
+#endif
+#if FEC
+  s->newpackets = 0;
+  s->paritycount = 0;
+  for (i = 0; i < 20; i++)
+    s->parity[i] = 0;
+#endif
   
   /* Initialize acked array */
   for (i = 0; i < SEQSPACE; i++) {
-    acked[i] = 0;
+    s->acked[i] = 0;
   }
 }
 
 /********* Receiver (B) variables and procedures ************/
 
-static int expectedseqnum;       /* the sequence number expected next by the receiver */
-static int B_nextseqnum;         /* the sequence number for the next packets sent by B */
-static struct pkt B_buffer[WINDOWSIZE]; /* buffer for out-of-order packets */
-static int B_received[SEQSPACE]; /* tracks which packets have been received */
-static int B_window_base;        /* base sequence number of receiver window */
+struct receiver {
+  int expectedseqnum;       /* the sequence number expected next by the receiver */
+  int B_nextseqnum;         /* the sequence number for the next packets sent by B */
+  struct pkt B_buffer[WINDOWSIZE]; /* buffer for out-of-order packets */
+  int B_received[SEQSPACE]; /* tracks which packets have been received */
+  int B_window_base;        /* base sequence number of receiver window */
+#if NAKS
+  float nakedat[SEQSPACE];  /* time B last asked for each missing packet */
+#endif
+#if FEC
+  int fecgroup;           /* parity group B is collecting */
+  int fecheard;           /* how many of its packets B has */
+  bool heard[FEC];        /* which ones */
+  char fecdata[FEC][20];  /* and their payloads */
+#endif
+};
+
+static struct receiver *receivers;  /* receiver state of each flow */
+
+#if FEC
+/* start collecting the packets of a parity group */
+static void startgroup(struct receiver *r, int group)
+{
+  int i;
+
+  r->fecgroup = group;
+  r->fecheard = 0;
+  for (i=0; i<FEC; i++)
+    r->heard[i] = false;
+}
+
+/* keep the packets of the group B is collecting, and when the group's
+   parity arrives with one of them missing, rebuild it.  Returns the
+   position in the group of the rebuilt packet, or -1 */
+static int collectgroup(struct receiver *r, struct pkt *packet)
+{
+  int pos, i, j;
+  char x;
+
+  if (packet->acknum < r->fecgroup)   /* a resend from a group already done */
+    return -1;
+  if (packet->acknum > r->fecgroup)   /* the rest of B's group and its parity were lost */
+    startgroup(r, packet->acknum);
+
+  if (packet->seqnum != PARITYFLAG) {
+    pos = seqdistance(packet->seqnum, groupfirst(r->fecgroup));
+    if (pos < FEC && !r->heard[pos]) {
+      for (i=0; i<20; i++)
+        r->fecdata[pos][i] = packet->payload[i];
+      r->heard[pos] = true;
+      r->fecheard++;
+    }
+    return -1;
+  }
+
+  /* the parity ends the group: XOR it with the packets B has to get the one it lacks */
+  if (r->fecheard != FEC - 1)
+    return -1;
+  for (pos=0; r->heard[pos]; pos++)
+    ;
+  for (i=0; i<20; i++) {
+    x = packet->payload[i];
+    for (j=0; j<FEC; j++)
+      if (j != pos)
+        x ^= r->fecdata[j][i];
+    r->fecdata[pos][i] = x;
+  }
+  r->heard[pos] = true;
+  r->fecheard++;
+  packets_rebuilt++;
+  if (TRACE > 0)
+    printf("----B: packet %d is rebuilt from the parity of group %d\n",
+           WRAP(groupfirst(r->fecgroup) + pos, SEQSPACE), r->fecgroup);
+  return pos;
+}
+
+/* packet pos of the group B is collecting, as A sent it */
+static struct pkt grouppacket(struct receiver *r, int pos)
+{
+  struct pkt packet;
+  int i;
+
+  packet.seqnum = WRAP(groupfirst(r->fecgroup) + pos, SEQSPACE);
+  packet.acknum = r->fecgroup;
+  for (i=0; i<20; i++)
+    packet.payload[i] = r->fecdata[pos][i];
+  packet.checksum = ComputeChecksum(packet);
+  return packet;
+}
+#endif
+
+
+#if NAKS
+/* packets before seqnum in the window are missing: ask A for each of them,
+   unless B already has within the last NAKHOLDOFF */
+static void sendnaks(struct receiver *r, int seqnum)
+{
+  struct pkt sendpkt;
+  int missing, i;
+
+  for (missing = r->B_window_base; missing != seqnum; missing = seqnext(missing)) {
+    if (r->B_received[missing] == 1)
+      continue;
+    if (r->nakedat[missing] != NOTNAKED && currenttime() - r->nakedat[missing] < NAKHOLDOFF)
+      continue;
+    r->nakedat[missing] = currenttime();
+
+    sendpkt.seqnum = NAKFLAG;
+    sendpkt.acknum = missing;
+    for (i = 0; i < 20; i++)
+      sendpkt.payload[i] = '0';
+    sendpkt.checksum = ComputeChecksum(sendpkt);
+    if (TRACE > 0)
+      printf("----B: packet %d is missing, send NAK!\n", missing);
+    tolayer3(B, sendpkt);
+    naks_sent++;
+  }
+}
+#endif
 
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 void B_input(struct pkt packet)
 {
+  struct receiver *r = &receivers[currentflow()];
   struct pkt sendpkt;
   int i;
   
+#if FEC
+  if (!IsCorrupted(packet)) {
+    i = collectgroup(r, &packet);
+    if (packet.seqnum == PARITYFLAG) {
+      /* B takes the rebuilt packet as if A had sent it again */
+      if (i >= 0)
+        B_input(grouppacket(r, i));
+      if (packet.acknum == r->fecgroup)
+        startgroup(r, r->fecgroup + 1);
+      return;
+    }
+  }
+#endif
+
   /* if not corrupted */
   if (!IsCorrupted(packet)) {
     if (TRACE > 0)
@@ -223,44 +525,41 @@ void B_input(struct pkt packet)
     /* Count every correctly received packet */
     packets_received++;
     
-    /* Calculate relative position to see if in window */
-    int relative_seq = (packet.seqnum - B_window_base + SEQSPACE) % SEQSPACE;
-    
     /* Check if packet is within the receiver window */
-    if (relative_seq < WINDOWSIZE) {
+    if (seqwithin(packet.seqnum, r->B_window_base, WINDOWSIZE)) {
       /* Valid packet within window */
       
-      /* Store the packet and mark it as received */
-      B_buffer[relative_seq] = packet;
-      B_received[packet.seqnum] = 1;
+      /* Store the packet and mark it as received.  The slot depends only on
+         the sequence number (SEQSPACE is a multiple of WINDOWSIZE), so it
+         stays put while the window base moves */
+      r->B_buffer[WRAP(packet.seqnum, WINDOWSIZE)] = packet;
+      r->B_received[packet.seqnum] = 1;
+#if NAKS
+      /* a gap before this packet means earlier ones were lost */
+      sendnaks(r, packet.seqnum);
+#endif
       
-      /* If this is the expected packet, deliver it and any consecutive buffered packets */
-      if (packet.seqnum == B_window_base) {
-        /* Deliver this packet */
-        tolayer5(B, packet.payload);
+      /* Deliver consecutive packets from the window base, then free their
+         sequence numbers for the next time round the sequence space */
+      while (r->B_received[r->B_window_base] == 1) {
+        tolayer5(B, r->B_buffer[WRAP(r->B_window_base, WINDOWSIZE)].payload);
+        r->B_received[r->B_window_base] = 0;
+#if NAKS
+        r->nakedat[r->B_window_base] = NOTNAKED;
+#endif
         
-        /* Move window base forward over all consecutively received packets */
-        B_window_base = (B_window_base + 1) % SEQSPACE;
-        
-        /* Check for consecutive packets that can now be delivered */
-        while (B_received[B_window_base] == 1) {
-          /* Deliver buffered packet */
-          int pos = (B_window_base - B_window_base + SEQSPACE) % SEQSPACE;
-          tolayer5(B, B_buffer[pos].payload);
-          
-          /* Advance window base */
-          B_window_base = (B_window_base + 1) % SEQSPACE;
-        }
-        
-        /* Update expected sequence number to match window base */
-        expectedseqnum = B_window_base;
+        /* Advance window base */
+        r->B_window_base = seqnext(r->B_window_base);
       }
+      
+      /* Update expected sequence number to match window base */
+      r->expectedseqnum = r->B_window_base;
     }
     
     /* Always send ACK for correctly received packet, regardless of whether it's in window */
     sendpkt.acknum = packet.seqnum;
-    sendpkt.seqnum = B_nextseqnum;
-    B_nextseqnum = (B_nextseqnum + 1) % 2;
+    sendpkt.seqnum = r->B_nextseqnum;
+    r->B_nextseqnum = (r->B_nextseqnum + 1) % 2;
     
     /* we don't have any data to send. fill payload with 0's */
     for (i = 0; i < 20; i++)
@@ -281,20 +580,57 @@ void B_input(struct pkt packet)
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
+/* It is called once for each flow sharing the link. */
 void B_init(void)
 {
+  struct receiver *r;
   int i;
   
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
-  B_window_base = 0;
+  if (receivers == NULL) {
+    receivers = calloc(numflows(), sizeof(struct receiver));
+    if (receivers == NULL) {
+      printf("memory allocation for receiver state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  r = &receivers[currentflow()];
+
+  r->expectedseqnum = 0;
+  r->B_nextseqnum = 1;
+  r->B_window_base = 0;
+#if FEC
+  startgroup(r, 0);
+#endif
   
   /* Initialize receiver buffer status */
   for (i = 0; i < SEQSPACE; i++) {
-    B_received[i] = 0;
+    r->B_received[i] = 0;
+#if NAKS
+    r->nakedat[i] = NOTNAKED;
+#endif
   }
 }
 
+#if SAMPLER
+/* state of a flow for the emulator's sampler */
+int A_windowdepth(int flow)
+{
+  return (senders != NULL) ? senders[flow].window.count : 0;
+}
+
+/* packets B holds until the ones before them arrive */
+int B_bufferdepth(int flow)
+{
+  int i, n = 0;
+
+  if (receivers == NULL)
+    return 0;
+  for (i = 0; i < SEQSPACE; i++)
+    n += receivers[flow].B_received[i];
+  return n;
+}
+#endif
+
 /******************************************************************************
  * The following functions need be completed only for bi-directional messages *
  *****************************************************************************/
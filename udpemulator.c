@@ -0,0 +1,636 @@
+/* ***** UDP LOOPBACK BACKEND FOR THE GBN/SR PROTOCOLS *****************
+   This file implements the same layer 3/5 and timer interface as
+   emulator.c (see emulator.h), but over real UDP sockets on localhost,
+   so the unchanged protocol code can be measured for packets per second
+   and CPU time per packet:
+
+     gcc -O2 -o gbn_udp udpemulator.c gbn.c
+     gcc -O2 -o sr_udp udpemulator.c sr.c
+
+   - A and B each have a UDP socket on 127.0.0.1, connected to each
+   other; every flow shares the pair, and each datagram carries its flow.
+   - one epoll loop waits on both sockets and a timerfd, which is armed
+   for the earliest entry of a timer heap holding the protocol timers,
+   the next message arrival of each flow and the packets held back by
+   the impairment shim.
+   - packets are sent with sendmmsg, in batches flushed once per pass of
+   the loop, and received with recvmmsg.
+   - the impairment shim in tolayer3 loses and corrupts packets the way
+   emulator.c does, and can hold each one back for a random delay,
+   keeping the packets of each direction in order, in place of netem.
+
+   Time is measured in time units of a length chosen at the start, so the
+   protocols' RTT keeps its meaning.  The run ends once every message has
+   been generated and nothing has happened for QUIETMS milliseconds with
+   no timers running.
+   ********************************************************************* */
+
+#define _GNU_SOURCE           /* sendmmsg, recvmmsg */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "emulator.h"
+#include "gbn.h"
+
+#define  BATCH     64          /* datagrams per sendmmsg/recvmmsg call */
+#define  QUIETMS   200         /* idle time that ends the run, in milliseconds */
+
+/* statistics updated by GBN */
+int window_full;
+int total_ACKs_received;
+int packets_resent;
+int new_ACKs;
+int packets_received;
+#if SENDQUEUE
+int messages_queued;
+int messages_dequeued;
+int queue_high_watermarks;
+int queue_low_watermarks;
+double queueing_delay;
+float max_queueing_delay;
+#endif
+#if NAKS
+int naks_sent;
+int naks_received;
+int nak_resends;
+#endif
+#if FEC
+int parity_sent;
+int packets_rebuilt;
+#endif
+
+int TRACE = 0;
+
+struct wirepkt {            /* datagram on the loopback: a packet and its flow */
+  int flow;
+  struct pkt packet;
+};
+
+#define  TIMER_INTERRUPT 0
+#define  FROM_LAYER5     1
+#define  DEPARTURE       2     /* packet held back by the shim is due to be sent */
+
+struct timer {              /* entry of the timer heap */
+  double when;              /* time units since the start */
+  unsigned long long seq;   /* order the timers were added in, for ties */
+  int type;                 /* one of the three above */
+  int entity;               /* 2*flow + A or B */
+  int index;                /* position in the heap */
+  struct wirepkt datagram;  /* DEPARTURE: datagram to send */
+  struct timer *next;       /* next free timer */
+};
+
+static struct timer **heap = NULL;     /* timers, earliest first */
+static int ntimers = 0;
+static int maxtimers = 0;
+static struct timer *freetimers = NULL;
+static unsigned long long ntimersadded = 0;
+
+static int nsim = 0;              /* number of messages from 5 to 4 so far */
+static int nsimmax = 0;           /* number of msgs to generate, then stop */
+static float lossprob;            /* probability that a packet is dropped */
+static float corruptprob;         /* probability that a packet is corrupted */
+static float lambda;              /* average time between messages from layer 5 */
+static float maxdelay;            /* largest delay added by the shim */
+static double unitns;             /* length of a time unit in nanoseconds */
+static int nflows = 1;
+static int curflow;               /* flow being handled */
+static struct timer **timers;     /* running timer of each entity, or NULL */
+static double lastdeparture[2];   /* latest departure held back towards A and B */
+static int *flowdelivered;
+
+static struct timespec start;     /* wall clock at the start of the run */
+static int sock[2];               /* sockets of A and B */
+static int epfd, tfd;
+
+static struct wirepkt outbuf[2][BATCH];   /* datagrams waiting to go from A and B */
+static struct mmsghdr outmsg[2][BATCH];
+static struct iovec outiov[2][BATCH];
+static int nout[2];
+
+/* statistics of the backend */
+static int messages_delivered;
+static int ntolayer3, nlost, ncorrupt, ndelayed;
+static long long nsent, nreceived, nsenddrops;
+static long long nsendcalls, nrecvcalls;
+
+static double now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((t.tv_sec - start.tv_sec) * 1e9 + (t.tv_nsec - start.tv_nsec)) / unitns;
+}
+
+static double uniform(void)
+{
+  return rand() / (double)RAND_MAX;
+}
+
+/********************** TIMER HEAP ***********************/
+
+static void place(struct timer *p, int i)
+{
+  heap[i] = p;
+  p->index = i;
+}
+
+/* timers due at the same time go off in the order they were added, so
+   departures held back to the same time keep their channel's order */
+static int earlier(const struct timer *p, const struct timer *q)
+{
+  if (p->when != q->when)
+    return p->when < q->when;
+  return p->seq < q->seq;
+}
+
+static void siftup(struct timer *p, int i)
+{
+  while (i > 0 && earlier(p, heap[(i - 1) / 2])) {
+    place(heap[(i - 1) / 2], i);
+    i = (i - 1) / 2;
+  }
+  place(p, i);
+}
+
+static void siftdown(struct timer *p, int i)
+{
+  int child;
+
+  while ((child = 2*i + 1) < ntimers) {
+    if (child + 1 < ntimers && earlier(heap[child + 1], heap[child]))
+      child++;
+    if (!earlier(heap[child], p))
+      break;
+    place(heap[child], i);
+    i = child;
+  }
+  place(p, i);
+}
+
+static struct timer *alloctimer(void)
+{
+  struct timer *p;
+
+  if (freetimers != NULL) {
+    p = freetimers;
+    freetimers = p->next;
+    return p;
+  }
+  p = malloc(sizeof(struct timer));
+  if (p == 0) {
+    printf("memory allocation for timer failed.");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static void freetimer(struct timer *p)
+{
+  p->next = freetimers;
+  freetimers = p;
+}
+
+static void addtimer(struct timer *p)
+{
+  if (ntimers == maxtimers) {
+    maxtimers = maxtimers ? 2*maxtimers : 64;
+    heap = realloc(heap, maxtimers * sizeof(struct timer *));
+    if (heap == 0) {
+      printf("memory allocation for the timer heap failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  p->seq = ntimersadded++;
+  siftup(p, ntimers++);
+}
+
+static void removetimer(struct timer *p)
+{
+  struct timer *last = heap[--ntimers];
+
+  if (last == p)
+    return;
+  if (p->index > 0 && earlier(last, heap[(p->index - 1) / 2]))
+    siftup(last, p->index);
+  else
+    siftdown(last, p->index);
+}
+
+/* arm the timerfd for the earliest timer, or disarm it */
+static void armtimerfd(void)
+{
+  struct itimerspec its;
+  double ns;
+
+  memset(&its, 0, sizeof(its));
+  if (ntimers > 0) {
+    ns = heap[0]->when * unitns;
+    its.it_value.tv_sec = start.tv_sec + (time_t)(ns / 1e9);
+    its.it_value.tv_nsec = start.tv_nsec + (long)(ns - (double)(time_t)(ns / 1e9) * 1e9);
+    if (its.it_value.tv_nsec >= 1000000000L) {
+      its.it_value.tv_sec++;
+      its.it_value.tv_nsec -= 1000000000L;
+    }
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+      its.it_value.tv_nsec = 1;   /* zero would disarm it */
+  }
+  timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/********************** SOCKETS ***********************/
+
+/* send the datagrams waiting to go from side AorB */
+static void flush(int AorB)
+{
+  int done, n;
+
+  done = 0;
+  while (done < nout[AorB]) {
+    n = sendmmsg(sock[AorB], &outmsg[AorB][done], nout[AorB] - done, 0);
+    nsendcalls++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      nsenddrops += nout[AorB] - done;   /* socket buffer full: the packets are lost */
+      break;
+    }
+    done += n;
+    nsent += n;
+  }
+  nout[AorB] = 0;
+}
+
+static void queuedatagram(int AorB, struct wirepkt *d)
+{
+  if (nout[AorB] == BATCH)
+    flush(AorB);
+  outbuf[AorB][nout[AorB]++] = *d;
+}
+
+static int opensocket(void)
+{
+  struct sockaddr_in addr;
+  int s;
+
+  s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (s < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    exit(EXIT_FAILURE);
+  }
+  return s;
+}
+
+static void opensockets(void)
+{
+  struct sockaddr_in addr[2];
+  struct epoll_event ev;
+  socklen_t len;
+  int i, j;
+
+  for (i=0; i<2; i++) {
+    sock[i] = opensocket();
+    len = sizeof(addr[i]);
+    getsockname(sock[i], (struct sockaddr *)&addr[i], &len);
+  }
+  for (i=0; i<2; i++)
+    if (connect(sock[i], (struct sockaddr *)&addr[!i], sizeof(addr[!i])) < 0) {
+      perror("connect");
+      exit(EXIT_FAILURE);
+    }
+  for (i=0; i<2; i++)
+    for (j=0; j<BATCH; j++) {
+      outiov[i][j].iov_base = &outbuf[i][j];
+      outiov[i][j].iov_len = sizeof(struct wirepkt);
+      outmsg[i][j].msg_hdr.msg_iov = &outiov[i][j];
+      outmsg[i][j].msg_hdr.msg_iovlen = 1;
+    }
+
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  epfd = epoll_create1(0);
+  if (tfd < 0 || epfd < 0) {
+    perror("epoll");
+    exit(EXIT_FAILURE);
+  }
+  ev.events = EPOLLIN;
+  for (i=0; i<2; i++) {
+    ev.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sock[i], &ev);
+  }
+  ev.data.u32 = 2;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+}
+
+/********************** EVENT HANDLING ***********************/
+
+static void (*const outputs[2])(struct msg) = { A_output, B_output };
+static void (*const inputs[2])(struct pkt) = { A_input, B_input };
+static void (*const timerinterrupts[2])(void) = { A_timerinterrupt, B_timerinterrupt };
+
+static void generate_next_arrival(int flow)
+{
+  struct timer *p = alloctimer();
+
+  p->when = now() + lambda*uniform()*2;
+  p->type = FROM_LAYER5;
+  p->entity = 2*flow + A;
+  addtimer(p);
+}
+
+static void fromlayer5(struct timer *p)
+{
+  struct msg msg2give;
+  int i;
+
+  if (nsim >= nsimmax)
+    return;
+  generate_next_arrival(curflow);
+  for (i=0; i<20; i++)
+    msg2give.data[i] = 97 + nsim % 26;
+  nsim++;
+  outputs[p->entity % 2](msg2give);
+}
+
+/* handle the timers that are due */
+static void runtimers(void)
+{
+  struct timer *p;
+  double t = now();
+
+  while (ntimers > 0 && heap[0]->when <= t) {
+    p = heap[0];
+    removetimer(p);
+    curflow = p->entity / 2;
+    if (p->type == TIMER_INTERRUPT) {
+      timers[p->entity] = NULL;
+      timerinterrupts[p->entity % 2]();
+    }
+    else if (p->type == FROM_LAYER5)
+      fromlayer5(p);
+    else
+      queuedatagram(p->entity % 2, &p->datagram);
+    freetimer(p);
+  }
+}
+
+/* receive everything waiting at side AorB and pass it up */
+static void receive(int AorB)
+{
+  struct wirepkt inbuf[BATCH];
+  struct mmsghdr inmsg[BATCH];
+  struct iovec iniov[BATCH];
+  int i, n;
+
+  for (i=0; i<BATCH; i++) {
+    iniov[i].iov_base = &inbuf[i];
+    iniov[i].iov_len = sizeof(struct wirepkt);
+    memset(&inmsg[i].msg_hdr, 0, sizeof(inmsg[i].msg_hdr));
+    inmsg[i].msg_hdr.msg_iov = &iniov[i];
+    inmsg[i].msg_hdr.msg_iovlen = 1;
+  }
+  while ((n = recvmmsg(sock[AorB], inmsg, BATCH, 0, NULL)) > 0) {
+    nrecvcalls++;
+    nreceived += n;
+    for (i=0; i<n; i++) {
+      if (inmsg[i].msg_len != sizeof(struct wirepkt) || inbuf[i].flow < 0 || inbuf[i].flow >= nflows)
+        continue;
+      curflow = inbuf[i].flow;
+      inputs[AorB](inbuf[i].packet);
+    }
+    if (n < BATCH)
+      break;
+  }
+}
+
+/********************** Student-callable ROUTINES ***********************/
+
+int currentflow(void)
+{
+  return curflow;
+}
+
+int numflows(void)
+{
+  return nflows;
+}
+
+float currenttime(void)
+{
+  return now();
+}
+
+void stoptimer(int AorB)
+{
+  struct timer **q = &timers[2*curflow + AorB];
+
+  if (*q == NULL) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  removetimer(*q);
+  freetimer(*q);
+  *q = NULL;
+}
+
+void starttimer(int AorB, double increment)
+{
+  struct timer **q = &timers[2*curflow + AorB];
+
+  if (*q != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
+  *q = alloctimer();
+  (*q)->when = now() + increment;
+  (*q)->type = TIMER_INTERRUPT;
+  (*q)->entity = 2*curflow + AorB;
+  addtimer(*q);
+}
+
+/* the impairment shim: lose, corrupt or hold back the packet, then send it */
+void tolayer3(int AorB, struct pkt packet)
+{
+  struct wirepkt d;
+  struct timer *p;
+  double x;
+
+  ntolayer3++;
+  if (uniform() < lossprob) {
+    nlost++;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being lost\n");
+    return;
+  }
+  d.flow = curflow;
+  d.packet = packet;
+  if (uniform() < corruptprob) {
+    ncorrupt++;
+    if ((x = uniform()) < .75)
+      d.packet.payload[0]='Z';   /* corrupt payload */
+    else if (x < .875)
+      d.packet.seqnum = 999999;
+    else
+      d.packet.acknum = 999999;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being corrupted\n");
+  }
+
+  if (maxdelay > 0.0) {
+    /* hold the packet back, but not past one sent after it */
+    p = alloctimer();
+    p->when = now() + maxdelay*uniform();
+    if (p->when < lastdeparture[!AorB])
+      p->when = lastdeparture[!AorB];
+    lastdeparture[!AorB] = p->when;
+    p->type = DEPARTURE;
+    p->entity = 2*curflow + AorB;
+    p->datagram = d;
+    addtimer(p);
+    ndelayed++;
+    return;
+  }
+  queuedatagram(AorB, &d);
+}
+
+void tolayer5(int AorB, char datasent[20])
+{
+  int i;
+
+  if (TRACE>2) {
+    printf("          TOLAYER5: data received by application at %c: ", (AorB == A) ? 'A' : 'B');
+    for (i=0; i<20; i++)
+      printf("%c",datasent[i]);
+    printf("\n");
+  }
+  messages_delivered++;
+  flowdelivered[curflow]++;
+}
+
+/********************** MAIN LOOP ***********************/
+
+static void init(void)
+{
+  float unitus;
+  int i;
+
+  printf("-----  UDP Loopback Network Backend -------- \n\n");
+  printf("Enter the number of messages to simulate: ");
+  scanf("%d",&nsimmax);
+  printf("Enter  packet loss probability [enter 0.0 for no loss]:");
+  scanf("%f",&lossprob);
+  printf("Enter packet corruption probability [0.0 for no corruption]:");
+  scanf("%f",&corruptprob);
+  printf("Enter largest delay added to a packet, in time units [0.0 for none]:");
+  scanf("%f",&maxdelay);
+  printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
+  scanf("%f",&lambda);
+  printf("Enter length of a time unit in microseconds:");
+  scanf("%f",&unitus);
+  printf("Enter number of flows sharing the sockets [1 for a single A/B pair]:");
+  scanf("%d",&nflows);
+  printf("Enter TRACE:");
+  scanf("%d",&TRACE);
+  if (nflows < 1)
+    nflows = 1;
+  if (unitus <= 0.0)
+    unitus = 1.0;
+  unitns = unitus * 1000.0;
+
+  timers = calloc(2*nflows, sizeof(struct timer *));
+  flowdelivered = calloc(nflows, sizeof(int));
+  if (timers == 0 || flowdelivered == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+  srand(9999);
+  opensockets();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i=0; i<nflows; i++) {
+    curflow = i;
+    A_init();
+    B_init();
+    generate_next_arrival(i);
+  }
+}
+
+int main(void)
+{
+  struct epoll_event evs[3];
+  struct rusage ru;
+  unsigned long long expirations;
+  double wall, cpu;
+  int i, n;
+
+  init();
+  while (1) {
+    runtimers();
+    flush(A);
+    flush(B);
+    armtimerfd();
+    n = epoll_wait(epfd, evs, 3, (ntimers > 0) ? -1 : QUIETMS);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;                      /* quiet for QUIETMS with no timers left */
+    for (i=0; i<n; i++) {
+      if (evs[i].data.u32 == 2) {
+        if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+          perror("timerfd");
+      }
+      else
+        receive(evs[i].data.u32);
+    }
+  }
+  wall = now() * unitns / 1e9;
+  getrusage(RUSAGE_SELF, &ru);
+  cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+
+  printf(" Backend stopped after %f s (%f time units)\n after attempting to send %d msgs from layer5\n",
+         wall, wall * 1e9 / unitns, nsim);
+  printf("number of messages dropped due to full window:  %d \n", window_full);
+  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
+  printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
+  printf("number of packet resends by A:  %d \n", packets_resent);
+  printf("number of correct packets received at B:  %d \n", packets_received);
+  printf("number of messages delivered to application:  %d \n", messages_delivered);
+#if SENDQUEUE
+  printf("number of messages queued while the window was full:  %d, of which sent:  %d \n",
+         messages_queued, messages_dequeued);
+  printf("average queueing delay of sent messages:  %f, maximum:  %f \n",
+         (messages_dequeued > 0) ? queueing_delay / messages_dequeued : 0.0, max_queueing_delay);
+#endif
+#if NAKS
+  printf("number of NAKs sent by B:  %d, received at A:  %d \n", naks_sent, naks_received);
+  printf("number of packet resends triggered by a NAK:  %d, by a timeout:  %d \n",
+         nak_resends, packets_resent - nak_resends);
+#endif
+#if FEC
+  printf("number of parity packets sent by A:  %d, packets rebuilt from them at B:  %d \n",
+         parity_sent, packets_rebuilt);
+#endif
+  printf("packets given to layer 3: %d, lost: %d, corrupted: %d, held back: %d \n",
+         ntolayer3, nlost, ncorrupt, ndelayed);
+  printf("datagrams sent: %lld in %lld sendmmsg calls, received: %lld in %lld recvmmsg calls, dropped by the socket: %lld \n",
+         nsent, nsendcalls, nreceived, nrecvcalls, nsenddrops);
+  printf("datagrams sent and received per second: %.0f, CPU time per datagram: %.3f microseconds \n",
+         (wall > 0.0) ? (nsent + nreceived) / wall : 0.0,
+         (nsent + nreceived > 0) ? cpu * 1e6 / (nsent + nreceived) : 0.0);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+/* the sender's sliding window, shared by gbn.c and sr.c.  Include it    */
+/* after defining WINDOWSIZE and SEQSPACE: everything here is compiled   */
+/* for those sizes, and when one of them is a power of two, wrapping     */
+/* round it is a mask rather than a division.                            */
+
+#ifndef WINDOW_H
+#define WINDOW_H
+
+/* x modulo n, for x >= 0 */
+#define WRAP(x, n)  ((((n) & ((n) - 1)) == 0) ? ((x) & ((n) - 1)) : ((x) % (n)))
+
+struct window {
+  struct pkt buffer[WINDOWSIZE];  /* packets sent and awaiting an ACK */
+  int first;                      /* array index of the oldest of them */
+  int count;                      /* the number of packets in the window */
+};
+
+/* the sequence number after seq */
+#define seqnext(seq)  WRAP((seq) + 1, SEQSPACE)
+
+/* the sequence number before seq */
+#define seqprev(seq)  WRAP((seq) + SEQSPACE - 1, SEQSPACE)
+
+/* how far seq is after base, going forward round the sequence space */
+#define seqdistance(seq, base)  WRAP((seq) - (base) + SEQSPACE, SEQSPACE)
+
+/* whether seq is one of the n sequence numbers starting at base */
+#define seqwithin(seq, base, n)  (seqdistance((seq), (base)) < (n))
+
+#define windowfull(w)  ((w)->count == WINDOWSIZE)
+
+/* the packet i places after the oldest in the window */
+#define windowat(w, i)  (&(w)->buffer[WRAP((w)->first + (i), WINDOWSIZE)])
+
+static void windowinit(struct window *w)
+{
+  w->first = 0;
+  w->count = 0;
+}
+
+/* add a packet after the newest.  The window must not be full */
+static struct pkt *windowpush(struct window *w, struct pkt packet)
+{
+  struct pkt *p = windowat(w, w->count);
+
+  *p = packet;
+  w->count++;
+  return p;
+}
+
+/* how many places after the oldest packet seq is, or -1 if it is not in the window */
+static int windowfind(struct window *w, int seq)
+{
+  int i;
+
+  if (w->count == 0 || seq < 0 || seq >= SEQSPACE)
+    return -1;
+  i = seqdistance(seq, w->buffer[w->first].seqnum);
+  return (i < w->count) ? i : -1;
+}
+
+/* range ACK: drop the n oldest packets */
+static void windowdrop(struct window *w, int n)
+{
+  w->first = WRAP(w->first + n, WINDOWSIZE);
+  w->count -= n;
+}
+
+/* for each packet p in the window, oldest first, i places after the oldest */
+#define WINDOW_FOREACH(w, i, p) \
+  for ((i) = 0; (i) < (w)->count && ((p) = windowat((w), (i))) != NULL; (i)++)
+
+#endif